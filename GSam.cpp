@@ -449,6 +449,15 @@ switch (cop) {
    return nfval;
  }
 
+ int GSamRecord::tag_int_array(const char tag[2], GVec<int64_t>& vals) {
+   vals.Clear();
+   uint8_t *s=find_tag(tag);
+   if (s==NULL || *s!='B') return 0;
+   uint32_t n=bam_auxB_len(s);
+   for (uint32_t i=0;i<n;i++) vals.Add(bam_auxB2i(s, i));
+   return n;
+ }
+
  double GSamRecord::tag_float(const char tag[2]) { //get the float value of tag
     uint8_t *s=bam_aux_get(this->b, tag);;
     if (s) return ( bam_aux2f(s) );
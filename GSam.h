@@ -1,9 +1,15 @@
 #ifndef _G_SAM_H
 #define _G_SAM_H
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "GBase.h"
 #include "GList.hh"
 #include "htslib/kstring.h"
 #include "htslib/sam.h"
+#include "htslib/bgzf.h"
+#include "htslib/hfile.h"
 #include "htslib/cram.h"
 
 class GSamReader;
@@ -185,6 +191,9 @@ class GSamRecord: public GSeg {
     int add_int_tag(const char tag[2], int64_t val) { //add or update int tag
     	return bam_aux_update_int(b, tag, val);
     }
+    int add_uint_array_tag(const char tag[2], uint32_t n, uint32_t* vals) { //add or update B:I tag
+    	return bam_aux_update_array(b, tag, 'I', n, vals);
+    }
     int remove_tag(const char tag[2]);
     inline int delete_tag(const char tag[2]) { return remove_tag(tag); }
 
@@ -234,6 +243,8 @@ class GSamRecord: public GSeg {
  double tag_float(const char tag[2]); //return float value of tag (for float types)
  char tag_char(const char tag[2]); //return char value of tag (for type 'A')
  char tag_char1(const char tag[2]);
+ //copy the values of a B (numeric array) tag into vals; returns the number of values (0 if no such tag)
+ int tag_int_array(const char tag[2], GVec<int64_t>& vals);
  char spliceStrand(); // '+', '-' from the XS tag, or '.' if no XS tag
  char* sequence(); //user should free after use
  char* qualities();//user should free after use
@@ -249,12 +260,22 @@ class GSamReader {
    char* fname;
    sam_hdr_t* hdr;
    bam1_t* b_next; //for light next(GBamRecord& b)
+   hts_idx_t* idx; //loaded on demand by the region query methods
+   hts_itr_t* itr; //when set, next() only returns records overlapping the query
+   int64_t susp_offset; //virtual file offset to resume reading from, if suspended
+   int64_t rec_offset; //virtual file offset of the last record read (BAM only, -1 otherwise)
+   bool is_bam; //BAM format, found when the file is opened
+   int readRec(bam1_t* b) {
+      rec_offset=(is_bam && hts_file->fp.bgzf!=NULL) ? bgzf_tell(hts_file->fp.bgzf) : -1;
+      return itr ? sam_itr_next(hts_file, itr, b) : sam_read1(hts_file, hdr, b);
+   }
  public:
    void bopen(const char* filename, int32_t required_fields,
 		   const char* cram_refseq=NULL) {
 	      hts_file=hts_open(filename, "r");
 	      if (hts_file==NULL)
 	         GError("Error: could not open alignment file %s \n",filename);
+	      is_bam=(hts_file->is_bgzf && hts_get_format(hts_file)->format==bam);
 	      if (hts_file->is_cram && cram_refseq!=NULL) {
 	              hts_set_opt(hts_file, CRAM_OPT_REFERENCE, cram_refseq);
     	  }
@@ -269,6 +290,7 @@ class GSamReader {
       hts_file=hts_open(filename, "r");
       if (hts_file==NULL)
          GError("Error: could not open alignment file %s \n",filename);
+      is_bam=(hts_file->is_bgzf && hts_get_format(hts_file)->format==bam);
       if (hts_file->is_cram) {
     	  if (cram_refseq!=NULL) {
               hts_set_opt(hts_file, CRAM_OPT_REFERENCE, cram_refseq);
@@ -283,41 +305,143 @@ class GSamReader {
    }
 
    GSamReader(const char* fn, int32_t required_fields,
-		   const char* cram_ref=NULL):hts_file(NULL),fname(NULL), hdr(NULL), b_next(NULL) {
+		   const char* cram_ref=NULL):hts_file(NULL),fname(NULL), hdr(NULL), b_next(NULL),
+		   idx(NULL), itr(NULL), susp_offset(-1), rec_offset(-1), is_bam(false) {
       bopen(fn, required_fields, cram_ref);
    }
 
    GSamReader(const char* fn, const char* cram_ref=NULL):hts_file(NULL),fname(NULL),
-		   hdr(NULL), b_next(NULL) {
+		   hdr(NULL), b_next(NULL), idx(NULL), itr(NULL), susp_offset(-1), rec_offset(-1),
+		   is_bam(false) {
       bopen(fn, cram_ref);
    }
 
-   sam_hdr_t* header() {
-      return hts_file ? hdr : NULL;
+   sam_hdr_t* header() { //still available after release() or suspend()
+      return hdr;
    }
    const char* fileName() {
       return fname;
    }
 
    const char* refName(int tid) {
-	   if (!hts_file) return NULL;
+	   if (!hdr) return NULL;
 	   return hdr->target_name[tid];
    }
 
-   void bclose() {
+   //close the file (releasing its descriptor and buffers) but keep the header,
+   // so the records already read remain valid
+   void release() {
+      clearRegions();
+      if (idx) { hts_idx_destroy(idx); idx=NULL; }
       if (hts_file) {
-   	    if (hdr!=NULL) sam_hdr_destroy(hdr);
-   	    hdr=NULL;
         hts_close(hts_file);
         hts_file=NULL;
-        }
+      }
+      susp_offset=-1;
+   }
+
+   void bclose() {
+      release();
+      if (hdr!=NULL) sam_hdr_destroy(hdr);
+      hdr=NULL;
     }
 
+   //release() a BAM file but remember the current position, so the next
+   // read call reopens it and continues from the same record
+   bool suspend() {
+      if (hts_file==NULL || itr!=NULL || !is_bam || hts_file->fp.bgzf==NULL) return false;
+      int64_t voffset=bgzf_tell(hts_file->fp.bgzf);
+      release();
+      susp_offset=voffset;
+      return true;
+   }
+
+   bool suspended() { return susp_offset>=0; }
+
+   //virtual file offset of the last record read, so reading can be restarted
+   // from it with seek(); -1 if not available (SAM/CRAM, sorted inputs etc.)
+   int64_t recOffset() { return rec_offset; }
+
+   //compressed file offset reached so far (BGZF files only, -1 otherwise)
+   int64_t filePos() {
+      if (hts_file==NULL) return (susp_offset>=0) ? (susp_offset>>16) : -1;
+      if (!hts_file->is_bgzf || hts_file->fp.bgzf==NULL) return -1;
+      return bgzf_tell(hts_file->fp.bgzf)>>16;
+   }
+
+   //the next read call continues from the record at virtual offset voffset (BAM only)
+   void seek(int64_t voffset) {
+      release();
+      susp_offset=voffset;
+   }
+
+   void resume() {
+      if (susp_offset<0) return;
+      hts_file=hts_open(fname, "r");
+      if (hts_file==NULL)
+         GError("Error: could not reopen alignment file %s \n", fname);
+      if (bgzf_seek(hts_file->fp.bgzf, susp_offset, SEEK_SET)<0)
+         GError("Error: could not seek in alignment file %s \n", fname);
+      susp_offset=-1;
+   }
+
    ~GSamReader() {
       if (b_next) bam_destroy1(b_next);
       bclose();
       GFREE(fname);
    }
+   //-- index based region queries (BAM/CRAM with .bai/.csi/.crai index)
+   bool hasIndex() {
+      if (idx==NULL && hts_file!=NULL) idx=sam_index_load(hts_file, fname);
+      return (idx!=NULL);
+   }
+
+   //restrict next() to records overlapping any of the given regions
+   // (samtools-style strings: "chr", "chr:beg" or "chr:beg-end", 1-based);
+   // overlapping regions are merged so each record is returned only once
+   bool setRegions(char** regs, int count) {
+      clearRegions();
+      if (count<=0) return false;
+      if (!hasIndex())
+         GError("Error: could not load the index for %s\n", fname);
+      itr=sam_itr_regarray(idx, hdr, regs, count);
+      return (itr!=NULL);
+   }
+
+   bool setRegion(const char* reg) {
+      clearRegions();
+      if (!hasIndex())
+         GError("Error: could not load the index for %s\n", fname);
+      itr=sam_itr_querys(idx, hdr, reg);
+      return (itr!=NULL);
+   }
+
+   //virtual offset of the first record on reference tid or on a later one,
+   // according to the index; -1 if there is no index or no such record
+   int64_t refOffset(int tid) {
+      if (susp_offset>=0) resume();
+      if (!hasIndex()) return -1;
+      int nrefs=sam_hdr_nref(hdr);
+      for (;tid<nrefs;tid++) {
+         hts_itr_t* it=sam_itr_queryi(idx, tid, 0, HTS_POS_MAX);
+         if (it==NULL) continue;
+         int64_t voffs=(it->n_off>0) ? (int64_t)it->off[0].u : -1;
+         hts_itr_destroy(it);
+         if (voffs>=0) return voffs;
+      }
+      return -1;
+   }
+
+   void clearRegions() {
+      if (itr) { hts_itr_destroy(itr); itr=NULL; }
+   }
+
+   //size of the cache of decompressed BGZF blocks, useful for repeated random access
+   void setCacheSize(size_t bytes) {
+      if (bytes>INT_MAX) bytes=INT_MAX; //htslib limit
+      if (hts_file) hts_set_cache_size(hts_file, (int)bytes);
+   }
+
    /*
    int64_t fpos() { //ftell
      if (hts_file->is_bgzf) { // bam_ptell() from sam.c
@@ -386,10 +510,11 @@ class GSamReader {
 
    //the caller has to FREE the created GSamRecord
    GSamRecord* next() {
+      if (susp_offset>=0) resume();
       if (hts_file==NULL)
         GError("Warning: GSamReader::next() called with no open file.\n");
       bam1_t* b = bam_init1();
-      if (sam_read1(hts_file, hdr, b) >= 0) {
+      if (readRec(b) >= 0) {
         GSamRecord* bamrec=new GSamRecord(b, hdr, true);
         return bamrec;
       }
@@ -397,11 +522,21 @@ class GSamReader {
       return NULL;
    }
 
+   //read the next record into b, without setting up a GSamRecord;
+   // returns <0 at the end of the file (or region)
+   int nextRaw(bam1_t* b) {
+      if (susp_offset>=0) resume();
+      if (hts_file==NULL)
+        GError("Warning: GSamReader::next() called with no open file.\n");
+      return readRec(b);
+   }
+
    bool next(GSamRecord& rec) {
+       if (susp_offset>=0) resume();
        if (hts_file==NULL)
 	        GError("Warning: GSamReader::next() called with no open file.\n");
 	   if (b_next==NULL) b_next=bam_init1();
-       if (sam_read1(hts_file, hdr, b_next) >= 0) {
+       if (readRec(b_next) >= 0) {
 	        rec.init(b_next, hdr, false);
 	        return true;
 	   }
@@ -454,7 +589,50 @@ class GSamWriter {
       ks_free(&mode);
    }
 
+   //continue writing a BAM file created earlier, after truncating it at file
+   // offset foffset (a BGZF block boundary, see flushBlocks()); the header
+   // is not written again
+   GSamWriter(const char* fname, sam_hdr_t* bh, int64_t foffset, GSamFileType ftype):
+		   bam_file(NULL),hdr(NULL) {
+      if (ftype!=GSamFile_BAM && ftype!=GSamFile_UBAM)
+         GError("Error: only BAM output files can be appended to!\n");
+      struct stat st;
+      if (stat(fname, &st)!=0)
+         GError("Error: could not access output file %s\n", fname);
+      if (st.st_size<foffset) //truncate() would pad it with zeros
+         GError("Error: output file %s is shorter (%lld bytes) than expected (%lld bytes)!\n",
+               fname, (long long)st.st_size, (long long)foffset);
+      if (truncate(fname, foffset)!=0)
+         GError("Error: could not truncate output file %s\n", fname);
+      hdr=sam_hdr_dup(bh);
+      bam_file=hts_open(fname, (ftype==GSamFile_UBAM) ? "abu" : "ab");
+      if (bam_file==NULL)
+         GError("Error: could not open output file %s for appending\n", fname);
+   }
+
+   //write out all the compressed data (ending the current BGZF block), make
+   // sure it is on disk and return the file offset where the next block
+   // starts (-1 if not BGZF)
+   int64_t flushBlocks() {
+      if (bam_file==NULL || !bam_file->is_bgzf) return -1;
+      BGZF* fp=bam_file->fp.bgzf;
+      if (bgzf_flush(fp)!=0 || hflush(fp->fp)!=0)
+         GError("Error: could not flush output file\n");
+      //hFILE does not expose its descriptor; fsync() of another descriptor
+      // of the same file writes out the same data
+      int fd=open(bam_file->fn, O_RDONLY);
+      if (fd<0 || fsync(fd)!=0)
+         GError("Error: could not sync output file %s\n", bam_file->fn);
+      close(fd);
+      return htell(fp->fp);
+   }
+
    sam_hdr_t* header() { return hdr; }
+   //use n threads for BGZF compression
+   void setThreads(int n) {
+      if (n>1 && hts_set_threads(bam_file, n)!=0)
+         GMessage("Warning: could not set up %d output threads\n", n);
+   }
    GSamWriter(const char* fname, const char* hdr_file, GSamFileType ftype=GSamFile_BAM):
 	                                             bam_file(NULL),hdr(NULL) {
 	  //create an output file fname with the SAM header copied from hdr_file
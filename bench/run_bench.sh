@@ -0,0 +1,62 @@
+#!/bin/env bash
+# Runs tiebrush and tiecov over synthetic data sets of increasing size and
+# appends one line per run to a tab-delimited results file, so the numbers
+# of different builds can be compared:
+#   date commit program samples reads_per_sample input_records wall_sec peak_rss_kb records_per_sec
+# usage: run_bench.sh [results_file]
+# The scale points are <samples>:<alignments per sample> pairs, which can be
+# changed with BENCH_POINTS; extra tbgen options can be given in BENCH_GEN_OPTS.
+# Generated data is kept in BENCH_DATA (default: ./data) and reused.
+results=${1:-bench_results.tsv}
+points=${BENCH_POINTS:-"10:100000 1000:5000 10000:500"}
+datadir=${BENCH_DATA:-data}
+genopts=${BENCH_GEN_OPTS:-"--hot-loci=50 --hot-depth=100 --tags=2 --long-frac=0.02"}
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+timecmd=/usr/bin/time
+if [[ ! -x $timecmd ]]; then
+  echo "Warning: GNU time not found, peak RSS will not be reported"
+  timecmd=""
+fi
+
+if [[ ! -f $results ]]; then
+  echo -e "date\tcommit\tprogram\tsamples\treads_per_sample\tinput_records\twall_sec\tpeak_rss_kb\trecords_per_sec" > $results
+fi
+
+#run a command, setting wall and rss
+run_timed () {
+  if [[ -n $timecmd ]]; then
+    $timecmd -f "%e %M" -o tst_time.txt "$@" || exit 1
+    read wall rss < tst_time.txt
+    /bin/rm -f tst_time.txt
+  else
+    local t0=$(date +%s.%N)
+    "$@" || exit 1
+    wall=$(echo "$(date +%s.%N) - $t0" | bc)
+    rss=NA
+  fi
+}
+
+#input records from a --stats report
+stat_records () {
+  sed -n 's/^ *"input_records": \([0-9]*\),/\1/p' $1
+}
+
+report () { # program samples reads stats_file
+  local nrec=$(stat_records $4)
+  local rate=$(awk -v n=$nrec -v t=$wall 'BEGIN { if (t>0) printf "%.0f", n/t; else print "NA" }')
+  echo -e "$(date +%Y-%m-%dT%H:%M:%S)\t$commit\t$1\t$2\t$3\t$nrec\t$wall\t$rss\t$rate" >> $results
+  echo "$1 $2 samples x $3: $wall s, $rss KB, $rate records/s"
+}
+
+for p in $points; do
+  n=${p%%:*}
+  r=${p##*:}
+  d=$datadir/n${n}_r${r}
+  if [[ ! -f $d/samples.txt ]]; then
+    ./tbgen -o $d -n $n -r $r $genopts || exit 1
+  fi
+  run_timed ../tiebrush --stats=$d/tst_tb.json -o $d/tst_tb.bam $d/samples.txt
+  report tiebrush $n $r $d/tst_tb.json
+  run_timed ../tiecov --stats=$d/tst_tc.json -c $d/tst_tc.coverage -j $d/tst_tc.junctions $d/tst_tb.bam
+  report tiecov $n $r $d/tst_tc.json
+done
@@ -0,0 +1,234 @@
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#include <sys/stat.h>
+
+#include "GArgs.h"
+#include "GStr.h"
+#include "GSam.h"
+
+#define VERSION "0.0.6"
+
+const char* USAGE="TBGen v" VERSION "\n"
+"==================\n"
+"Generates a synthetic multi-sample data set for benchmarking TieBrush and\n"
+"TieCov: N coordinate-sorted BAM files with the same reference sequences,\n"
+"where a fraction of the alignments is shared across samples.\n"
+"==================\n"
+"\n"
+" usage: tbgen -o OUTDIR [-n samples] [-r reads] [options]\n"
+"\n"
+"  -o\t\toutput directory, created if needed; the files are\n"
+"    \t\tOUTDIR/s<i>.bam and their list is OUTDIR/samples.txt\n"
+"  -n\t\tnumber of samples (default: 10)\n"
+"  -r\t\talignments per sample (default: 20000)\n"
+"  -t\t\tnumber of threads (default: 4)\n"
+"  --refs\tnumber of reference sequences (default: 4)\n"
+"  --ref-len\tlength of each reference sequence (default: 5000000)\n"
+"  --read-len\tshort read length (default: 100)\n"
+"  --long-len\tlong read length (default: 3000)\n"
+"  --long-frac\tfraction of long reads (default: 0)\n"
+"  --splice-rate\tfraction of spliced alignments; long reads get one\n"
+"               \tintron per 1000 bases (default: 0.2)\n"
+"  --dup-rate\tfraction of the alignments of a sample taken from a pool\n"
+"            \tshared by all samples (default: 0.5)\n"
+"  --hot-loci\tnumber of hot loci (default: 20)\n"
+"  --hot-depth\talignments per sample starting at each hot locus, in\n"
+"             \ta few distinct variants (default: 200)\n"
+"  --tags\tnumber of extra 16 character string tags per alignment,\n"
+"        \tat most 36 (default: 0)\n"
+"  --seed\trandom seed (default: 1)\n";
+
+struct TGenAln {
+	int tid;
+	int pos; //0-based
+	bool rev;
+	int qlen;
+	std::vector<uint32_t> cigar;
+	bool operator<(const TGenAln& o) const {
+		return (tid!=o.tid) ? tid<o.tid : pos<o.pos;
+	}
+};
+
+struct TGenParams {
+	int numSamples=10;
+	int numReads=20000;
+	int numRefs=4;
+	int refLen=5000000;
+	int readLen=100;
+	int longLen=3000;
+	double longFrac=0;
+	double spliceRate=0.2;
+	double dupRate=0.5;
+	int hotLoci=20;
+	int hotDepth=200;
+	int numTags=0;
+	uint64_t seed=1;
+} params;
+
+GStr outdir;
+std::vector<TGenAln> pool; //alignments shared by the samples
+std::vector<TGenAln> hotVariants; //alignments starting at the hot loci (4 per locus)
+const int hotVariantCount=4;
+
+TGenAln genAln(std::mt19937_64& rng, bool isLong) {
+	TGenAln a;
+	a.qlen=isLong ? params.longLen : params.readLen;
+	std::uniform_real_distribution<double> unif(0, 1);
+	int nintrons=0;
+	if (unif(rng)<params.spliceRate) nintrons=isLong ? GMAX(1, a.qlen/1000) : 1;
+	std::uniform_int_distribution<int> ilen(80, 5000);
+	std::vector<int> introns;
+	int span=a.qlen;
+	for (int i=0;i<nintrons;i++) {
+		introns.push_back(ilen(rng));
+		span+=introns.back();
+	}
+	std::uniform_int_distribution<int> tidd(0, params.numRefs-1);
+	std::uniform_int_distribution<int> posd(0, GMAX(0, params.refLen-span-1));
+	a.tid=tidd(rng);
+	a.pos=posd(rng);
+	a.rev=(unif(rng)<0.5);
+	//exon blocks of about the same length, separated by the introns
+	int left=a.qlen;
+	for (int i=0;i<=nintrons;i++) {
+		int blen=(i==nintrons) ? left : a.qlen/(nintrons+1);
+		left-=blen;
+		a.cigar.push_back(bam_cigar_gen(blen, BAM_CMATCH));
+		if (i<nintrons) a.cigar.push_back(bam_cigar_gen(introns[i], BAM_CREF_SKIP));
+	}
+	return a;
+}
+
+void writeSample(int s) {
+	std::mt19937_64 rng(params.seed*1000003+s+1);
+	std::uniform_real_distribution<double> unif(0, 1);
+	std::uniform_int_distribution<size_t> poold(0, pool.size()-1);
+	std::vector<TGenAln> alns;
+	alns.reserve(params.numReads+params.hotLoci*params.hotDepth);
+	for (int i=0;i<params.numReads;i++) {
+		if (unif(rng)<params.dupRate) alns.push_back(pool[poold(rng)]);
+		else alns.push_back(genAln(rng, unif(rng)<params.longFrac));
+	}
+	std::uniform_int_distribution<int> vard(0, hotVariantCount-1);
+	for (int h=0;h<params.hotLoci;h++)
+		for (int d=0;d<params.hotDepth;d++)
+			alns.push_back(hotVariants[h*hotVariantCount+vard(rng)]);
+	std::stable_sort(alns.begin(), alns.end());
+
+	GStr text("@HD\tVN:1.6\tSO:coordinate\n");
+	for (int r=0;r<params.numRefs;r++)
+		text.appendfmt("@SQ\tSN:chr%d\tLN:%d\n", r+1, params.refLen);
+	text.appendfmt("@RG\tID:s%d\tSM:s%d\n", s, s);
+	sam_hdr_t* hdr=sam_hdr_parse(text.length(), text.chars());
+	if (hdr==NULL) GError("Error: failed to create the header of sample %d\n", s);
+	GStr fname(outdir);
+	fname.appendfmt("/s%d.bam", s);
+	GSamWriter writer(fname.chars(), hdr, GSamFile_BAM);
+	sam_hdr_destroy(hdr);
+
+	static const char bases[]="ACGT";
+	std::string seq, tagval(16, 'A');
+	bam1_t* b=bam_init1();
+	for (size_t i=0;i<alns.size();i++) {
+		TGenAln& a=alns[i];
+		GStr qname;
+		qname.appendfmt("s%d.%d", s, (int)i);
+		seq.resize(a.qlen);
+		for (int j=0;j<a.qlen;j++) seq[j]=bases[rng() & 3];
+		if (bam_set1(b, qname.length(), qname.chars(), a.rev ? BAM_FREVERSE : 0, a.tid, a.pos, 60,
+				a.cigar.size(), a.cigar.data(), -1, -1, 0, a.qlen, seq.c_str(), NULL,
+				64+params.numTags*20)<0)
+			GError("Error: failed to build record %s\n", qname.chars());
+		int32_t nh=1, nm=0;
+		bam_aux_append(b, "NH", 'i', 4, (uint8_t*)&nh);
+		bam_aux_append(b, "NM", 'i', 4, (uint8_t*)&nm);
+		if (a.cigar.size()>1) {
+			char xs=a.rev ? '-' : '+';
+			bam_aux_append(b, "XS", 'A', 1, (uint8_t*)&xs);
+		}
+		for (int t=0;t<params.numTags;t++) { //X0..X9, then ZA..ZZ
+			char tag[2]={ t<10 ? 'X' : 'Z', (char)(t<10 ? '0'+t : 'A'+t-10) };
+			for (int j=0;j<16;j++) tagval[j]=bases[rng() & 3];
+			bam_aux_append(b, tag, 'Z', tagval.length()+1, (uint8_t*)tagval.c_str());
+		}
+		writer.write(b);
+	}
+	bam_destroy1(b);
+}
+
+int main(int argc, char* argv[]) {
+	GArgs args(argc, argv, "help;refs=;ref-len=;read-len=;long-len=;long-frac=;splice-rate=;"
+			"dup-rate=;hot-loci=;hot-depth=;tags=;seed=;ho:n:r:t:");
+	args.printError(USAGE, true);
+	if (args.getOpt('h') || args.getOpt("help")) {
+		fprintf(stdout, "%s", USAGE);
+		exit(0);
+	}
+	outdir=args.getOpt('o');
+	if (outdir.is_empty()) {
+		GMessage(USAGE);
+		GMessage("\nError: output directory must be provided (-o)!\n");
+		exit(1);
+	}
+	GStr v;
+	int nthreads=4;
+	if (!(v=args.getOpt('n')).is_empty()) params.numSamples=v.asInt();
+	if (!(v=args.getOpt('r')).is_empty()) params.numReads=v.asInt();
+	if (!(v=args.getOpt('t')).is_empty()) nthreads=v.asInt();
+	if (!(v=args.getOpt("refs")).is_empty()) params.numRefs=v.asInt();
+	if (!(v=args.getOpt("ref-len")).is_empty()) params.refLen=v.asInt();
+	if (!(v=args.getOpt("read-len")).is_empty()) params.readLen=v.asInt();
+	if (!(v=args.getOpt("long-len")).is_empty()) params.longLen=v.asInt();
+	if (!(v=args.getOpt("long-frac")).is_empty()) params.longFrac=v.asReal();
+	if (!(v=args.getOpt("splice-rate")).is_empty()) params.spliceRate=v.asReal();
+	if (!(v=args.getOpt("dup-rate")).is_empty()) params.dupRate=v.asReal();
+	if (!(v=args.getOpt("hot-loci")).is_empty()) params.hotLoci=v.asInt();
+	if (!(v=args.getOpt("hot-depth")).is_empty()) params.hotDepth=v.asInt();
+	if (!(v=args.getOpt("tags")).is_empty()) params.numTags=v.asInt();
+	if (!(v=args.getOpt("seed")).is_empty()) params.seed=v.asInt();
+	if (params.numSamples<1 || params.numReads<0 || params.numRefs<1 || params.readLen<1 ||
+			params.longLen<1 || params.refLen<=GMAX(params.readLen, params.longLen) || nthreads<1)
+		GError("Error: invalid parameter values!\n");
+	if (params.numTags<0 || params.numTags>36) GError("Error: --tags must be between 0 and 36!\n");
+	mkdir(outdir.chars(), 0755);
+
+	//the shared pool and the hot loci are the same for all samples
+	std::mt19937_64 rng(params.seed);
+	std::uniform_real_distribution<double> unif(0, 1);
+	int psize=GMAX(100, params.numReads/2);
+	for (int i=0;i<psize;i++) pool.push_back(genAln(rng, unif(rng)<params.longFrac));
+	for (int h=0;h<params.hotLoci;h++) {
+		TGenAln locus=genAln(rng, false);
+		//room for the longest variant (one 5000 bases intron)
+		locus.pos=GMAX(0, GMIN(locus.pos, params.refLen-params.readLen-5001));
+		for (int k=0;k<hotVariantCount;k++) { //same start, different alignments
+			TGenAln a=genAln(rng, false);
+			a.tid=locus.tid;
+			a.pos=locus.pos;
+			a.rev=(k & 1);
+			hotVariants.push_back(a);
+		}
+	}
+
+	std::atomic<int> next(0);
+	auto worker=[&]() {
+		int s;
+		while ((s=next++)<params.numSamples) writeSample(s);
+	};
+	std::vector<std::thread> workers;
+	for (int t=0;t<GMIN(nthreads, params.numSamples);t++) workers.push_back(std::thread(worker));
+	for (size_t t=0;t<workers.size();t++) workers[t].join();
+
+	GStr lstfn(outdir);
+	lstfn.append("/samples.txt");
+	FILE* f=fopen(lstfn.chars(), "w");
+	if (f==NULL) GError("Error creating file %s\n", lstfn.chars());
+	for (int s=0;s<params.numSamples;s++) fprintf(f, "%s/s%d.bam\n", outdir.chars(), s);
+	fclose(f);
+	GMessage("%d samples written to %s (%s)\n", params.numSamples, outdir.chars(), lstfn.chars());
+	return 0;
+}
@@ -0,0 +1,399 @@
+#include <vector>
+#include <string>
+#include <random>
+#include <algorithm>
+#include <time.h>
+
+#include "GArgs.h"
+#include "GStr.h"
+#include "GSam.h"
+#include "tbrush.h"
+#include "tcov.h"
+
+#define VERSION "0.0.6"
+
+const char* USAGE="TBMicro v" VERSION "\n"
+"==================\n"
+"Times the per-record kernels of TieBrush and TieCov (merge keys, segment\n"
+"lists, coverage and junction accumulation, CIGAR decoding) over generated\n"
+"alignment records, and reports ns/op and allocations/op for each of them.\n"
+"==================\n"
+"\n"
+" usage: tbmicro [-n records] [options]\n"
+"\n"
+"  -n\t\tnumber of alignment records (default: 100000)\n"
+"  -k\t\tonly run the kernels with this string in their name\n"
+"  --min-time\tminimum run time of each kernel, in milliseconds\n"
+"            \t(default: 300)\n"
+"  --samples\tnumber of samples the records are spread over (default: 16)\n"
+"  --read-len\tread length (default: 100)\n"
+"  --splice-rate\tfraction of spliced alignments (default: 0.15)\n"
+"  --clip-rate\tfraction of soft clipped alignments (default: 0.1)\n"
+"  --indel-rate\tfraction of alignments with an insertion or a deletion\n"
+"              \t(default: 0.05)\n"
+"  --dup-rate\tfraction of records repeating one of the previous records,\n"
+"            \thalf of them with a different MD tag (default: 0.4)\n"
+"  --seed\trandom seed (default: 1)\n";
+
+//-- allocation counting: every malloc/calloc/realloc call (operator new
+// goes through malloc) is counted; glibc exports the real allocator
+// under __libc_* names, elsewhere only operator new can be counted
+static uint64_t allocCount=0;
+
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t n, size_t size);
+void* __libc_realloc(void* p, size_t size);
+
+void* malloc(size_t size) {
+	allocCount++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+	allocCount++;
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* p, size_t size) {
+	allocCount++;
+	return __libc_realloc(p, size);
+}
+}
+const char* allocNote="malloc, calloc and realloc calls";
+#else
+void* operator new(size_t size) {
+	allocCount++;
+	void* p=malloc(size ? size : 1);
+	if (p==NULL) GError("Error: out of memory!\n");
+	return p;
+}
+void operator delete(void* p) noexcept { free(p); }
+const char* allocNote="operator new calls only";
+#endif
+
+struct TMicroParams {
+	int numRecs=100000;
+	int numRefs=4;
+	int refLen=2000000;
+	int numSamples=16;
+	int readLen=100;
+	double spliceRate=0.15;
+	double clipRate=0.1;
+	double indelRate=0.05;
+	double dupRate=0.4;
+	int minTime=300;
+	uint64_t seed=1;
+} params;
+
+GStr kernelFilter;
+
+//generated records, in coordinate order
+sam_hdr_t* hdr=NULL;
+std::vector<bam1_t*> brecs;
+GPVec<GSamRecord> recs(true); //not owning their bam1_t data
+std::vector<char> tstrands; //as SPData::tstrand
+std::vector<int> samples; //sample of each record, for the segment lists
+volatile uint64_t benchSink=0; //keeps the results of the kernels alive
+
+static inline uint64_t nsNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+//short read CIGARs: mostly plain matches, some soft clipped, spliced
+// (rarely twice) or with a small indel
+std::vector<uint32_t> genCigar(std::mt19937_64& rng) {
+	std::vector<uint32_t> cig;
+	std::uniform_real_distribution<double> unif(0, 1);
+	int len=params.readLen;
+	int clipL=0, clipR=0;
+	if (unif(rng)<params.clipRate) {
+		int c=1+rng()%(len/5);
+		if (rng() & 1) clipL=c;
+		else clipR=c;
+	}
+	if (clipL) cig.push_back(bam_cigar_gen(clipL, BAM_CSOFT_CLIP));
+	int mlen=len-clipL-clipR;
+	double u=unif(rng);
+	if (u<params.spliceRate) {
+		int nintrons=(unif(rng)<0.15) ? 2 : 1;
+		std::uniform_int_distribution<int> ilen(80, 20000);
+		int left=mlen;
+		for (int i=0;i<=nintrons;i++) {
+			int blen=(i==nintrons) ? left : 8+rng()%(left-8*(nintrons-i+1)+1);
+			left-=blen;
+			cig.push_back(bam_cigar_gen(blen, BAM_CMATCH));
+			if (i<nintrons) cig.push_back(bam_cigar_gen(ilen(rng), BAM_CREF_SKIP));
+		}
+	}
+	else if (u<params.spliceRate+params.indelRate) {
+		int a=10+rng()%(mlen-20);
+		int k=1+rng()%3;
+		if (rng() & 1) { //insertion
+			cig.push_back(bam_cigar_gen(a, BAM_CMATCH));
+			cig.push_back(bam_cigar_gen(k, BAM_CINS));
+			cig.push_back(bam_cigar_gen(mlen-a-k, BAM_CMATCH));
+		}
+		else {
+			cig.push_back(bam_cigar_gen(a, BAM_CMATCH));
+			cig.push_back(bam_cigar_gen(k, BAM_CDEL));
+			cig.push_back(bam_cigar_gen(mlen-a, BAM_CMATCH));
+		}
+	}
+	else cig.push_back(bam_cigar_gen(mlen, BAM_CMATCH));
+	if (clipR) cig.push_back(bam_cigar_gen(clipR, BAM_CSOFT_CLIP));
+	return cig;
+}
+
+//MD string with nmis mismatches spread over the aligned bases
+std::string genMD(const std::vector<uint32_t>& cig, int nmis, std::mt19937_64& rng) {
+	static const char bases[]="ACGT";
+	int mlen=0;
+	for (size_t i=0;i<cig.size();i++)
+		if (bam_cigar_op(cig[i])==BAM_CMATCH) mlen+=bam_cigar_oplen(cig[i]);
+	std::vector<bool> mis(mlen, false);
+	for (int i=0;i<nmis;i++) mis[rng()%mlen]=true;
+	std::string md;
+	int run=0, mpos=0;
+	for (size_t i=0;i<cig.size();i++) {
+		int op=bam_cigar_op(cig[i]), len=bam_cigar_oplen(cig[i]);
+		if (op==BAM_CMATCH) {
+			for (int k=0;k<len;k++, mpos++) {
+				if (!mis[mpos]) { run++; continue; }
+				md+=std::to_string(run);
+				md+=bases[rng() & 3];
+				run=0;
+			}
+		}
+		else if (op==BAM_CDEL) {
+			md+=std::to_string(run);
+			md+='^';
+			for (int k=0;k<len;k++) md+=bases[rng() & 3];
+			run=0;
+		}
+	}
+	md+=std::to_string(run);
+	return md;
+}
+
+struct TMicroAln {
+	int tid;
+	int pos;
+	bool rev;
+	std::vector<uint32_t> cigar;
+	std::string md;
+	bool operator<(const TMicroAln& o) const {
+		return (tid!=o.tid) ? tid<o.tid : pos<o.pos;
+	}
+};
+
+void genRecords() {
+	std::mt19937_64 rng(params.seed);
+	std::uniform_real_distribution<double> unif(0, 1);
+	std::uniform_int_distribution<int> tidd(0, params.numRefs-1);
+	std::uniform_int_distribution<int> posd(0, params.refLen-params.readLen-45000);
+	std::vector<TMicroAln> alns;
+	alns.reserve(params.numRecs);
+	for (int i=0;i<params.numRecs;i++) {
+		if (i>0 && unif(rng)<params.dupRate) { //same alignment as a recent one
+			TMicroAln a=alns[i-1-rng()%GMIN(i, 8)];
+			if (rng() & 1) a.md=genMD(a.cigar, 1+rng()%2, rng);
+			alns.push_back(a);
+			continue;
+		}
+		TMicroAln a;
+		a.tid=tidd(rng);
+		a.pos=posd(rng);
+		a.rev=(rng() & 1);
+		a.cigar=genCigar(rng);
+		a.md=genMD(a.cigar, (unif(rng)<0.7) ? 0 : 1+rng()%3, rng);
+		alns.push_back(a);
+	}
+	std::stable_sort(alns.begin(), alns.end());
+
+	GStr text("@HD\tVN:1.6\tSO:coordinate\n");
+	for (int r=0;r<params.numRefs;r++)
+		text.appendfmt("@SQ\tSN:chr%d\tLN:%d\n", r+1, params.refLen);
+	hdr=sam_hdr_parse(text.length(), text.chars());
+	if (hdr==NULL) GError("Error: failed to create the SAM header\n");
+	static const char bases[]="ACGT";
+	std::string seq(params.readLen, 'A');
+	std::uniform_int_distribution<int> smpd(0, params.numSamples-1);
+	for (size_t i=0;i<alns.size();i++) {
+		TMicroAln& a=alns[i];
+		GStr qname;
+		qname.appendfmt("r%d", (int)i);
+		for (int j=0;j<params.readLen;j++) seq[j]=bases[rng() & 3];
+		bam1_t* b=bam_init1();
+		if (bam_set1(b, qname.length(), qname.chars(), a.rev ? BAM_FREVERSE : 0, a.tid, a.pos, 60,
+				a.cigar.size(), a.cigar.data(), -1, -1, 0, params.readLen, seq.c_str(), NULL, 64)<0)
+			GError("Error: failed to build record %s\n", qname.chars());
+		int32_t nh=1+((rng()%10==0) ? rng()%4 : 0), as=-(int32_t)(rng()%12), nm=0;
+		bam_aux_append(b, "NH", 'i', 4, (uint8_t*)&nh);
+		bam_aux_append(b, "AS", 'i', 4, (uint8_t*)&as);
+		bam_aux_append(b, "NM", 'i', 4, (uint8_t*)&nm);
+		bam_aux_append(b, "MD", 'Z', a.md.length()+1, (uint8_t*)a.md.c_str());
+		bool spliced=false;
+		for (size_t c=0;c<a.cigar.size();c++)
+			if (bam_cigar_op(a.cigar[c])==BAM_CREF_SKIP) spliced=true;
+		if (spliced) {
+			char xs=a.rev ? '-' : '+';
+			bam_aux_append(b, "XS", 'A', 1, (uint8_t*)&xs);
+		}
+		brecs.push_back(b);
+		GSamRecord* r=new GSamRecord(b, hdr, false);
+		recs.Add(r);
+		tstrands.push_back(r->spliceStrand());
+		samples.push_back(smpd(rng));
+	}
+}
+
+//run pass() (each call processes ops records or pairs) until the minimum run
+// time is reached; setup() is called, untimed, before each pass
+template<class S, class P> void runKernel(const char* name, uint64_t ops, S setup, P pass) {
+	if (!kernelFilter.is_empty() && strstr(name, kernelFilter.chars())==NULL) return;
+	uint64_t elapsed=0, allocs=0, nops=0;
+	uint64_t tmin=(uint64_t)params.minTime*1000000ULL;
+	while (elapsed<tmin || nops==0) {
+		setup();
+		uint64_t a0=allocCount;
+		uint64_t t0=nsNow();
+		benchSink+=pass();
+		elapsed+=nsNow()-t0;
+		allocs+=allocCount-a0;
+		nops+=ops;
+	}
+	fprintf(stdout, "%-26s %10.2f %10.4f %12llu\n", name, (double)elapsed/nops,
+			(double)allocs/nops, (unsigned long long)nops);
+}
+
+//alignments at the same start are compared most of the time
+// (they are the ones being merged), so the pairs are neighbours
+template<class C> uint64_t cmpPairs(C cmp) {
+	uint64_t sum=0;
+	for (int i=1;i<recs.Count();i++)
+		sum+=(cmp(*recs[i-1], *recs[i])<0);
+	return sum;
+}
+
+int main(int argc, char* argv[]) {
+	GArgs args(argc, argv, "help;min-time=;samples=;read-len=;splice-rate=;clip-rate=;indel-rate=;"
+			"dup-rate=;seed=;hn:k:");
+	args.printError(USAGE, true);
+	if (args.getOpt('h') || args.getOpt("help")) {
+		fprintf(stdout, "%s", USAGE);
+		exit(0);
+	}
+	GStr v;
+	if (!(v=args.getOpt('n')).is_empty()) params.numRecs=v.asInt();
+	if (!(v=args.getOpt('k')).is_empty()) kernelFilter=v;
+	if (!(v=args.getOpt("min-time")).is_empty()) params.minTime=v.asInt();
+	if (!(v=args.getOpt("samples")).is_empty()) params.numSamples=v.asInt();
+	if (!(v=args.getOpt("read-len")).is_empty()) params.readLen=v.asInt();
+	if (!(v=args.getOpt("splice-rate")).is_empty()) params.spliceRate=v.asReal();
+	if (!(v=args.getOpt("clip-rate")).is_empty()) params.clipRate=v.asReal();
+	if (!(v=args.getOpt("indel-rate")).is_empty()) params.indelRate=v.asReal();
+	if (!(v=args.getOpt("dup-rate")).is_empty()) params.dupRate=v.asReal();
+	if (!(v=args.getOpt("seed")).is_empty()) params.seed=v.asInt();
+	if (params.numRecs<2 || params.numSamples<1 || params.readLen<40 || params.minTime<0)
+		GError("Error: invalid parameter values!\n");
+	genRecords();
+	uint64_t n=recs.Count();
+	GMessage("%llu records, allocations counted as %s\n", (unsigned long long)n, allocNote);
+	fprintf(stdout, "%-26s %10s %10s %12s\n", "kernel", "ns/op", "allocs/op", "ops");
+	auto nosetup=[]() { };
+
+	//-- GSamRecord::setupCoordinates, as called by the readers for each record
+	GSamRecord scratch;
+	runKernel("setupCoordinates", n, nosetup, [&]() {
+		uint64_t s=0;
+		for (size_t i=0;i<brecs.size();i++) {
+			scratch.init(brecs[i], hdr, false);
+			s+=scratch.exons.Count();
+		}
+		return s;
+	});
+
+	//-- merge keys
+	uint32_t flags=0;
+	runKernel("cmpCigar", n-1, nosetup, [&]() {
+		return cmpPairs([&](GSamRecord& a, GSamRecord& b) { return cmpCigar(a, b, flags); });
+	});
+	runKernel("cmpCigarClip", n-1, nosetup, [&]() {
+		return cmpPairs([&](GSamRecord& a, GSamRecord& b) { return cmpCigarClip(a, b, flags); });
+	});
+	runKernel("cmpExons", n-1, nosetup, [&]() {
+		return cmpPairs([&](GSamRecord& a, GSamRecord& b) { return cmpExons(a, b, flags); });
+	});
+	runKernel("cmpFull", n-1, nosetup, [&]() {
+		return cmpPairs([&](GSamRecord& a, GSamRecord& b) { return cmpFull(a, b, flags); });
+	});
+	//SPData::operator< for each merge strategy
+	const char* stratNames[4]={ "cigar", "full", "clip", "exon" };
+	for (int st=tMrgStratCIGAR;st<=tMrgStratExon;st++) {
+		GStr kname("SPData::operator<[");
+		kname.append(stratNames[st]);
+		kname.append("]");
+		runKernel(kname.chars(), n-1, nosetup, [&]() {
+			uint64_t s=0;
+			for (int i=1;i<recs.Count();i++)
+				s+=(cmpMergeKey(*recs[i-1], tstrands[i-1], *recs[i], tstrands[i],
+						(TMrgStrategy)st, flags)<0);
+			return s;
+		});
+	}
+
+	//-- segment lists (YD values): one list per sample and strand,
+	// released at each new reference like mergeInputs() does
+	RDistanceData rspacing;
+	runKernel("GSegList::processRead", n, [&]() { rspacing.init(params.numSamples); }, [&]() {
+		uint64_t s=0;
+		int ltid=-1;
+		for (int i=0;i<recs.Count();i++) {
+			GSamRecord& r=*recs[i];
+			if (r.refId()!=ltid) {
+				rspacing.reset();
+				ltid=r.refId();
+			}
+			if (tstrands[i]=='+' || tstrands[i]=='.') s+=rspacing.fwd(samples[i]).processRead(r);
+			if (tstrands[i]=='-' || tstrands[i]=='.') s+=rspacing.rev(samples[i]).processRead(r);
+		}
+		return s;
+	});
+	GSegList segs;
+	runKernel("GSegList::mergeRead", n, [&]() { segs.reset(); }, [&]() {
+		int ltid=-1;
+		for (int i=0;i<recs.Count();i++) {
+			GSamRecord& r=*recs[i];
+			if (r.refId()!=ltid) {
+				segs.clear();
+				ltid=r.refId();
+			}
+			segs.mergeRead(r);
+		}
+		return (uint64_t)segs.count();
+	});
+
+	//-- TieCov accumulators
+	GVec<uint64_t> bcov;
+	uint64_t zero=0;
+	bcov.Resize(params.refLen, zero);
+	runKernel("addCov", n, nosetup, [&]() {
+		for (int i=0;i<recs.Count();i++) addCov(*recs[i], 1, bcov, 1);
+		return bcov[recs[0]->start];
+	});
+	CJuncTable* junctions=NULL;
+	runKernel("addJunction", n, [&]() { delete junctions; junctions=new CJuncTable(); }, [&]() {
+		for (int i=0;i<recs.Count();i++) junctions->addRead(*recs[i], 1);
+		return (uint64_t)junctions->jset.size();
+	});
+	delete junctions;
+
+	recs.Clear();
+	for (size_t i=0;i<brecs.size();i++) bam_destroy1(brecs[i]);
+	sam_hdr_destroy(hdr);
+	return 0;
+}
@@ -13,6 +13,7 @@
 #include <utility>
 #include <stdlib.h>
 #include <fstream>
+#include <sys/stat.h>
 
 #include "GStr.h"
 #include "GSam.h"
@@ -54,30 +55,205 @@ static inline bool parse_pg_sample_line(std::string& line) { // returns true if
     return true;
 }
 
-static inline void load_sample_info(sam_hdr_t* hdr,std::vector<std::string>& info){
+// Binary sample registry ("sidecar") file, an alternative to storing one
+// "@CO SAMPLE:<path>" header line per sample. Layout (little-endian):
+//   char magic[8] ("TBSREG01"), uint32_t num_samples, uint32_t reserved,
+//   uint64_t names_len, uint64_t offsets[num_samples+1], names (\0-terminated)
+// The alignment file header refers to it with a single line:
+//   @CO	SAMPLEREG:<hash>:<num_samples>:<file name>
+// where <hash> is the FNV-1a hash of the names block (16 hex digits) and the
+// file is looked up in the directory of the alignment file first.
+#define TB_SAMPLE_REG_MAGIC "TBSREG01"
+#define TB_SAMPLE_REG_TAG "SAMPLEREG:"
+#define TB_SAMPLE_REG_EXT ".tbs"
+
+struct TSampleRegistry {
+    std::vector<uint64_t> offsets;
+    std::vector<char> names;
+    uint64_t hash;
+    TSampleRegistry():offsets(), names(), hash(0) { }
+
+    static uint64_t hashNames(const char* data, size_t len) {
+        uint64_t h=14695981039346656037ULL;
+        for (size_t i=0;i<len;i++) {
+            h^=(uint8_t)data[i];
+            h*=1099511628211ULL;
+        }
+        return h;
+    }
+
+    int count() { return offsets.empty() ? 0 : (int)offsets.size()-1; }
+    const char* name(int idx) { //O(1) lookup
+        if (idx<0 || idx>=count())
+            GError("Error: sample index %d out of range (%d samples)!\n", idx, count());
+        return names.data()+offsets[idx];
+    }
+
+    void build(const std::vector<std::string>& samples) {
+        offsets.clear();
+        names.clear();
+        for (uint i=0;i<samples.size();i++) {
+            offsets.push_back(names.size());
+            names.insert(names.end(), samples[i].c_str(), samples[i].c_str()+samples[i].length()+1);
+        }
+        offsets.push_back(names.size());
+        hash=hashNames(names.data(), names.size());
+    }
+
+    void write(const char* fn) {
+        FILE* f=fopen(fn, "wb");
+        if (f==NULL) GError("Error creating sample registry file %s\n", fn);
+        uint32_t num=count();
+        uint32_t reserved=0;
+        uint64_t nlen=names.size();
+        if (fwrite(TB_SAMPLE_REG_MAGIC, 1, 8, f)!=8 || fwrite(&num, sizeof(num), 1, f)!=1 ||
+                fwrite(&reserved, sizeof(reserved), 1, f)!=1 || fwrite(&nlen, sizeof(nlen), 1, f)!=1 ||
+                fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), f)!=offsets.size() ||
+                fwrite(names.data(), 1, nlen, f)!=nlen)
+            GError("Error writing sample registry file %s\n", fn);
+        fclose(f);
+    }
+
+    bool load(const char* fn) {
+        FILE* f=fopen(fn, "rb");
+        if (f==NULL) return false;
+        char magic[8];
+        uint32_t num=0, reserved=0;
+        uint64_t nlen=0;
+        if (fread(magic, 1, 8, f)!=8 || memcmp(magic, TB_SAMPLE_REG_MAGIC, 8)!=0 ||
+                fread(&num, sizeof(num), 1, f)!=1 || fread(&reserved, sizeof(reserved), 1, f)!=1 ||
+                fread(&nlen, sizeof(nlen), 1, f)!=1)
+            GError("Error: %s is not a valid sample registry file!\n", fn);
+        //the counts must match the file size before anything is allocated
+        struct stat st;
+        uint64_t dsize=(fstat(fileno(f), &st)==0) ? (uint64_t)st.st_size-ftell(f) : 0;
+        if (((uint64_t)num+1)*sizeof(uint64_t)>dsize || nlen!=dsize-((uint64_t)num+1)*sizeof(uint64_t))
+            GError("Error: sample registry file %s is truncated or corrupt!\n", fn);
+        offsets.resize((size_t)num+1);
+        names.resize(nlen);
+        if (fread(offsets.data(), sizeof(uint64_t), offsets.size(), f)!=offsets.size() ||
+                fread(names.data(), 1, nlen, f)!=nlen)
+            GError("Error: sample registry file %s is truncated!\n", fn);
+        fclose(f);
+        //each name must be a non-empty span ending with its \0
+        bool valid=(offsets[0]==0 && offsets[num]==nlen);
+        for (uint32_t i=0;valid && i<num;i++)
+            valid=(offsets[i]<offsets[i+1] && offsets[i+1]<=nlen && names[offsets[i+1]-1]==0);
+        if (!valid) GError("Error: sample registry file %s is corrupt!\n", fn);
+        hash=hashNames(names.data(), names.size());
+        return true;
+    }
+
+    //header line referring to this registry, stored as file name fn
+    std::string headerLine(const char* fn) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%016llx:%d:", (unsigned long long)hash, count());
+        std::string line(TB_SAMPLE_REG_TAG);
+        line+=buf;
+        const char* p=strrchr(fn, '/');
+        line+=(p==NULL) ? fn : p+1;
+        return line;
+    }
+
+    //load the registry referenced by a SAMPLEREG header line (text after "@CO\t")
+    // of alignment file aln_fname; returns false if the line is not a SAMPLEREG line
+    bool loadFromHeaderLine(const char* line, const char* aln_fname) {
+        int taglen=strlen(TB_SAMPLE_REG_TAG);
+        if (strncmp(line, TB_SAMPLE_REG_TAG, taglen)!=0) return false;
+        const char* p=line+taglen;
+        char* endp=NULL;
+        uint64_t h=strtoull(p, &endp, 16);
+        if (endp==p || *endp!=':') GError("Error: invalid sample registry header line: %s\n", line);
+        p=endp+1;
+        long num=strtol(p, &endp, 10);
+        if (endp==p || *endp!=':') GError("Error: invalid sample registry header line: %s\n", line);
+        const char* e=endp+1;
+        std::string fn(e, strcspn(e, "\t\n"));
+        std::string lfn(fn);
+        const char* d=(aln_fname!=NULL) ? strrchr(aln_fname, '/') : NULL;
+        if (d!=NULL) lfn=std::string(aln_fname, d-aln_fname+1)+fn;
+        if (!load(lfn.c_str()) && !load(fn.c_str()))
+            GError("Error: could not find sample registry file %s (referenced by %s)\n",
+                   fn.c_str(), aln_fname ? aln_fname : "header");
+        if (hash!=h || count()!=num)
+            GError("Error: sample registry file %s does not match the header of %s!\n",
+                   lfn.c_str(), aln_fname ? aln_fname : "");
+        return true;
+    }
+};
+
+//visit each line of the header text in place
+template<class F> static inline void scan_hdr_lines(sam_hdr_t* hdr, F f) {
+    const char* p=sam_hdr_str(hdr);
+    while (p!=NULL && *p) {
+        const char* eol=strchr(p, '\n');
+        if (eol==NULL) eol=p+strlen(p);
+        if (!f(p, eol)) break;
+        p=(*eol) ? eol+1 : eol;
+    }
+}
+
+//collect the sample names from a sample registry, "@CO SAMPLE:" lines or
+// (older files) "@PG ID:SAMPLE SP:" lines; aln_fname is used to locate the
+// registry file; returns false (or fails if required) if none are found
+static inline bool load_sample_info(sam_hdr_t* hdr,std::vector<std::string>& info,
+        const char* aln_fname=NULL, bool required=true){
     bool found_sample_line = false;
-    int line_pos = 0;
-    std::string line;
-    while(true){
-        kstring_t str = KS_INITIALIZE;
-        if (sam_hdr_find_line_pos(hdr, "PG", line_pos, &str)!=0) {
-            if(!found_sample_line){
-                GError("Error: no sample lines found in header");
+    TSampleRegistry reg;
+    scan_hdr_lines(hdr, [&](const char* p, const char* eol) {
+        if (eol-p>4 && memcmp(p, "@CO\t", 4)==0) {
+            std::string line(p+4, eol-p-4);
+            if (reg.loadFromHeaderLine(line.c_str(), aln_fname)) {
+                for (int i=0;i<reg.count();i++) info.push_back(reg.name(i));
+                found_sample_line=true;
+            }
+            else if (line.compare(0, 7, "SAMPLE:")==0) {
+                size_t t=line.find('\t', 7);
+                info.push_back(line.substr(7, (t==std::string::npos) ? t : t-7));
+                found_sample_line=true;
             }
-            break;
         }
-        else{
-            // parse line to check if indeed SAMPLE PG
-            line = std::string(str.s);
-            bool ret = parse_pg_sample_line(line);
-            if(ret){
+        else if (eol-p>4 && memcmp(p, "@PG\t", 4)==0) {
+            std::string line(p, eol-p);
+            if (parse_pg_sample_line(line)) {
                 found_sample_line=true;
                 info.push_back(line);
             }
-            line_pos++;
         }
-        ks_free(&str);
-    }
+        return true;
+    });
+    if (!found_sample_line && required)
+        GError("Error: no sample lines found in header");
+    return found_sample_line;
+}
+
+//"@CO GROUPS:name1,name2,..." lists the sample groups in the order of the
+// values in the per-group count tags
+#define TB_GROUPS_TAG "GROUPS:"
+#define TB_GROUP_COV_TAG "YG"
+#define TB_GROUP_SMP_TAG "YS"
+
+//collect the group names from the GROUPS header line; returns false if there is none
+static inline bool load_group_names(sam_hdr_t* hdr, std::vector<std::string>& names) {
+    bool found=false;
+    const size_t tlen=strlen(TB_GROUPS_TAG);
+    scan_hdr_lines(hdr, [&](const char* p, const char* eol) {
+        if (eol-p>(long)(4+tlen) && memcmp(p, "@CO\t", 4)==0 &&
+                memcmp(p+4, TB_GROUPS_TAG, tlen)==0) {
+            const char* s=p+4+tlen;
+            while (s<eol) {
+                const char* e=s;
+                while (e<eol && *e!=',' && *e!='\t') e++;
+                if (e>s) names.push_back(std::string(s, e-s));
+                if (e==eol || *e=='\t') break;
+                s=e+1;
+            }
+            found=true;
+            return false;
+        }
+        return true;
+    });
+    return found;
 }
 
 static inline std::string get_full_path(std::string fname) {
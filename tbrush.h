@@ -0,0 +1,270 @@
+#ifndef TIEBRUSH_TBRUSH_H_
+#define TIEBRUSH_TBRUSH_H_
+
+#include "GBase.h"
+#include "GVec.hh"
+#include "GList.hh"
+#include "GSam.h"
+
+// The per-record kernels of the TieBrush merge: the merge keys of the
+// alignments starting at the same position and the per-sample segment
+// lists behind the YD (bundle extent) values. They are kept here so that
+// bench/tbmicro can time them outside of a full run.
+
+enum TMrgStrategy {
+	tMrgStratCIGAR=0,  // same CIGAR (MD may differ)
+	tMrgStratFull, // same CIGAR and MD
+	tMrgStratClip,   // same CIGAR after clipping
+	tMrgStratExon    // same exons
+};
+
+struct GSegList { //per sample per strand
+  // sorted, non-overlapping segments kept in a flat array; segments before
+  // head were released and their storage is reused after the next compaction
+  GVec<GSeg> segs;
+  int head;
+  uint last_pos;
+  int last_dist;
+  GSegList():segs(8), head(0), last_pos(0), last_dist(-1) { }
+
+  void reset() {
+	  clear();
+	  last_pos=0;
+	  last_dist=-1;
+  }
+
+  void clear() { //release all segments at once, keeping the allocated capacity
+	  segs.setCount(0);
+	  head=0;
+  }
+
+  int count() { return segs.Count()-head; }
+
+  void clearTo(int idx) {
+	  //release every segment up to and *including* segs[idx]
+	  head=idx+1;
+	  if (head>=segs.Count()) {
+		  clear();
+		  return;
+	  }
+	  if (head>=32 && head*2>=segs.Count()) { //compact the live segments
+		  int n=segs.Count()-head;
+		  for (int i=0;i<n;i++) segs[i]=segs[head+i];
+		  segs.setCount(n);
+		  head=0;
+	  }
+  }
+
+  //index of the last segment starting before pos, or -1 if none
+  int findBefore(uint pos) {
+	  int l=head, r=segs.Count();
+	  while (l<r) {
+		  int m=(l+r)>>1;
+		  if (segs[m].start<pos) l=m+1;
+		  else r=m;
+	  }
+	  return (l>head) ? l-1 : -1;
+  }
+
+  void mergeSeg(GSeg& e) {
+	  //first segment ending at or after e.start
+	  int l=head, r=segs.Count();
+	  while (l<r) {
+		  int m=(l+r)>>1;
+		  if (segs[m].end<e.start) l=m+1;
+		  else r=m;
+	  }
+	  if (l==segs.Count()) return; //see mergeRead()
+	  if (e.end<segs[l].start) { //no overlap, insert before segs[l]
+		  segs.Insert(l, e);
+		  return;
+	  }
+	  //overlap: the union replaces segs[l], swallowing any following overlapped segments
+	  uint nstart=GMIN(e.start, segs[l].start);
+	  uint nend=GMAX(e.end, segs[l].end);
+	  int j=l+1;
+	  while (j<segs.Count() && segs[j].start<=nend) {
+		  if (segs[j].end>nend) nend=segs[j].end;
+		  j++;
+	  }
+	  segs[l].start=nstart;
+	  segs[l].end=nend;
+	  for (int k=j-1;k>l;k--) segs.Delete(k);
+  }
+
+ void mergeRead(GSamRecord& r) {
+	 if (count()==0) {
+		 for (int i=0;i<r.exons.Count();i++)
+			 segs.Add(r.exons[i]);
+		 return;
+	 }
+	 //NOTE: exons starting past the end of the last segment are not appended
+	 // (same as the original linked list version, which YD values depend on)
+	 for (int i=0;i<r.exons.Count();i++)
+		 mergeSeg(r.exons[i]);
+ }
+
+ int processRead(GSamRecord& r) { //return d=current bundle extent upstream
+	 //if the read starts after a gap, d=0
+	 //this should only be called ONCE per collapsed read and sample
+	 //should NOT be called on reads coming from already merged samples!
+	 if (last_pos==r.start) { //already called on the same sample and start position
+	     mergeRead(r);
+		 return last_dist;
+	 }
+	 int d=0;
+	 int prev=findBefore(r.start); //last segment starting before r
+	 if (prev>=0) {
+		 if (segs[prev].end>=r.start)  // r overlaps prev segment
+			d=r.start - segs[prev].start;
+		 if (d==0)
+			clearTo(prev); //clear all segments including prev
+	 }
+
+     if (last_pos!=r.start) {
+    	 last_pos=r.start;
+    	 last_dist=d;
+     }
+     mergeRead(r);
+	 return d;
+ }
+
+};
+
+
+struct RDistanceData {
+  // per-sample segment lists are only created for samples that have reads
+  // on the current chromosome; reset() returns them to a pool for reuse
+  struct SampleSegs {
+	  GSegList fsegs; //forward strand segs
+	  GSegList rsegs; //reverse strand segs
+  };
+  GVec<SampleSegs*> samples; //NULL for samples not seen on this chromosome
+  GVec<int> active; //indexes of samples with a non-NULL entry in samples
+  GPVec<SampleSegs> pool; //released lists, ready for reuse
+  RDistanceData():samples(), active(), pool(true) { }
+  ~RDistanceData() {
+	  for (int i=0;i<active.Count();i++) delete samples[active[i]];
+  }
+  void init(int num_samples) {
+	  this->reset();
+	  SampleSegs* none=NULL;
+	  samples.Resize(num_samples, none);
+  }
+  SampleSegs& get(int s) {
+	  SampleSegs* ss=samples[s];
+	  if (ss==NULL) {
+		  if (pool.Count()>0) ss=pool.Pop();
+		  else ss=new SampleSegs();
+		  samples[s]=ss;
+		  active.Add(s);
+	  }
+	  return *ss;
+  }
+  GSegList& fwd(int s) { return get(s).fsegs; }
+  GSegList& rev(int s) { return get(s).rsegs; }
+  void reset() { //only touches the samples seen since the previous reset
+	  for (int i=0;i<active.Count();i++) {
+		  SampleSegs* ss=samples[active[i]];
+		  ss->fsegs.reset();
+		  ss->rsegs.reset();
+		  pool.Add(ss);
+		  samples[active[i]]=NULL;
+	  }
+	  active.Clear();
+  }
+};
+
+// check the two reads for compatibility with user provided flags (-F)
+inline int cmpFlags(GSamRecord& a, GSamRecord& b, uint32_t flags){
+    if(flags == 0){
+        return 0;
+    }
+    if((flags & a.get_b()->core.flag) == (flags & b.get_b()->core.flag)){ // make sure the user-requested flags are the same between reads
+        return 0;
+    }
+    return 1;
+}
+
+inline int cmpFull(GSamRecord& a, GSamRecord& b, uint32_t flags) {
+    //-- Flags
+    bool cmp_flag = cmpFlags(a,b,flags);
+    if(cmp_flag!=0) return cmp_flag;
+	//-- CIGAR && MD strings
+	if (a.get_b()->core.n_cigar!=b.get_b()->core.n_cigar) return ((int)a.get_b()->core.n_cigar - (int)b.get_b()->core.n_cigar);
+	int cigar_cmp=0;
+	if (a.get_b()->core.n_cigar>0)
+		cigar_cmp=memcmp(bam_get_cigar(a.get_b()) , bam_get_cigar(b.get_b()), a.get_b()->core.n_cigar*sizeof(uint32_t) );
+	if (cigar_cmp!=0) return cigar_cmp;
+	// compare MD tag
+	char* aMD=a.tag_str("MD");
+	char* bMD=b.tag_str("MD");
+	if (aMD==NULL || bMD==NULL) {
+		if (aMD==bMD) return 0;
+		if (aMD!=NULL) return 1;
+		return -1;
+	}
+    return strcmp(aMD, bMD);
+}
+
+inline int cmpCigar(GSamRecord& a, GSamRecord& b, uint32_t flags) {
+    bool cmp_flag = cmpFlags(a,b,flags);
+    if(cmp_flag!=0) return cmp_flag;
+	if (a.get_b()->core.n_cigar!=b.get_b()->core.n_cigar) return ((int)a.get_b()->core.n_cigar - (int)b.get_b()->core.n_cigar);
+	if (a.get_b()->core.n_cigar==0) return 0;
+	return memcmp(bam_get_cigar(a.get_b()) , bam_get_cigar(b.get_b()), a.get_b()->core.n_cigar*sizeof(uint32_t) );
+}
+
+inline int cmpCigarClip(GSamRecord& a, GSamRecord& b, uint32_t flags) {
+    bool cmp_flag = cmpFlags(a,b,flags);
+    if(cmp_flag!=0) return cmp_flag;
+	uint32_t a_clen=a.get_b()->core.n_cigar;
+	uint32_t b_clen=b.get_b()->core.n_cigar;
+	uint32_t* a_cstart=bam_get_cigar(a.get_b());
+	uint32_t* b_cstart=bam_get_cigar(b.get_b());
+	while (a_clen>0 &&
+			((*a_cstart) & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) { a_cstart++; a_clen--; }
+	while (a_clen>0 &&
+			(a_cstart[a_clen-1] & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) a_clen--;
+	while (b_clen>0 &&
+			((*b_cstart) & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) { b_cstart++; b_clen--; }
+	while (b_clen>0 &&
+			(b_cstart[b_clen-1] & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) b_clen--;
+	if (a_clen!=b_clen) return (int)a_clen-(int)b_clen;
+	if (a_clen==0) return 0;
+	return memcmp(a_cstart, b_cstart, a_clen*sizeof(uint32_t));
+}
+
+inline int cmpExons(GSamRecord& a, GSamRecord& b, uint32_t flags) {
+    bool cmp_flag = cmpFlags(a,b,flags);
+    if(cmp_flag!=0) return cmp_flag;
+	if (a.exons.Count()!=b.exons.Count()) return (a.exons.Count()-b.exons.Count());
+	for (int i=0;i<a.exons.Count();i++) {
+		if (a.exons[i].start!=b.exons[i].start)
+			return ((int)a.exons[i].start-(int)b.exons[i].start);
+		if (a.exons[i].end!=b.exons[i].end)
+			return ((int)a.exons[i].end-(int)b.exons[i].end);
+	}
+	return 0;
+}
+
+//sort order of the alignments starting at the same position (see SPData):
+// reference, start, transcription strand, end, then the merge key of the strategy
+inline int cmpMergeKey(GSamRecord& a, char astrand, GSamRecord& b, char bstrand,
+		TMrgStrategy strategy, uint32_t flags) {
+	if (a.refId()!=b.refId()) return (a.refId()<b.refId()) ? -1 : 1;
+	//NOTE: already assuming that start&end must match, no matter the merge strategy
+	if (a.start!=b.start) return (a.start<b.start) ? -1 : 1;
+	if (astrand!=bstrand) return (astrand<bstrand) ? -1 : 1;
+	if (a.end!=b.end) return (a.end<b.end) ? -1 : 1;
+	switch (strategy) {
+	  case tMrgStratCIGAR: return cmpCigar(a, b, flags);
+	  case tMrgStratFull: return cmpFull(a, b, flags);
+	  case tMrgStratClip: return cmpCigarClip(a, b, flags);
+	  case tMrgStratExon: return cmpExons(a, b, flags);
+	  default: GError("Error: unknown merge strategy!\n");
+	}
+	return 0;
+}
+
+#endif /* TIEBRUSH_TBRUSH_H_ */
@@ -0,0 +1,186 @@
+#ifndef TIEBRUSH_TCOV_H_
+#define TIEBRUSH_TCOV_H_
+
+#include <vector>
+#include <queue>
+#include <unordered_set>
+#include "GBase.h"
+#include "GVec.hh"
+#include "GSam.h"
+
+// The per-record kernels of TieCov: base coverage accumulation and the
+// genome-wide splice junction table (also timed by bench/tbmicro).
+
+struct CJunc {
+	int tid;
+	int start, end;
+	char strand;
+	uint64_t dupcount;
+	int maxLeft, maxRight; //maximum anchor overhang on either side of the junction
+	CJunc(int vtid=-1, int vs=0, int ve=0, char vstrand='+', uint64_t dcount=1,
+			int vleft=0, int vright=0):tid(vtid), start(vs), end(ve), strand(vstrand),
+			dupcount(dcount), maxLeft(vleft), maxRight(vright) { }
+
+	bool operator==(const CJunc& a) const {
+		return (tid==a.tid && strand==a.strand && start==a.start && end==a.end);
+	}
+
+    bool operator<(const CJunc& a) const { // sort by strand last
+        if (tid!=a.tid) return (tid<a.tid);
+        if (start==a.start){
+            if(end==a.end){
+                return strand<a.strand;
+            }
+            else{
+                return (end<a.end);
+            }
+        }
+        else{
+            return (start<a.start);
+        }
+    }
+
+	void add(CJunc& j) {
+       dupcount+=j.dupcount;
+       if (j.maxLeft>maxLeft) maxLeft=j.maxLeft;
+       if (j.maxRight>maxRight) maxRight=j.maxRight;
+	}
+
+	void write(FILE* f, const char* chr, int id, bool tophat) {
+		if (tophat) { //two-block BED, each block as long as the maximum overhang
+			int bstart=start-1-maxLeft;
+			if (bstart<0) bstart=0;
+			int bend=end+maxRight;
+			fprintf(f, "%s\t%d\t%d\tJUNC%08d\t%ld\t%c\t%d\t%d\t255,0,0\t2\t%d,%d\t0,%d\n",
+					chr, bstart, bend, id, (long)dupcount, strand, bstart, bend,
+					start-1-bstart, maxRight, end-bstart);
+		}
+		else
+		  fprintf(f, "%s\t%d\t%d\tJUNC%08d\t%ld\t%c\n",
+				chr, start-1, end, id, (long)dupcount, strand);
+	}
+};
+
+struct CJuncHash {
+	size_t operator()(const CJunc& j) const {
+		uint64_t h=((uint64_t)(uint32_t)j.tid<<32) ^ (uint32_t)j.start;
+		h=h*0x9E3779B97F4A7C15ULL ^ (((uint64_t)(uint32_t)j.end<<8) | (uint8_t)j.strand);
+		return (size_t)(h ^ (h>>29));
+	}
+};
+
+struct CJuncEq {
+	bool operator()(const CJunc& a, const CJunc& b) const {
+		return (a.tid==b.tid && a.start==b.start && a.end==b.end && a.strand==b.strand);
+	}
+};
+
+struct CJuncPtrGreater { //min-heap order for the flush queue
+	bool operator()(const CJunc* a, const CJunc* b) const { return (*b < *a); }
+};
+
+// genome-wide junction accumulator: each junction is looked up by hash
+// and only written out (in sorted order) once no more reads can reach it
+struct CJuncTable {
+	std::unordered_set<CJunc, CJuncHash, CJuncEq> jset;
+	std::priority_queue<CJunc*, std::vector<CJunc*>, CJuncPtrGreater> jqueue;
+	int numWritten=0; //junctions are numbered in the output, starting at 1
+	bool tophat=false; //write two-block BED with the anchor overhangs
+
+	void add(CJunc& j) {
+		auto ins=jset.insert(j);
+		CJunc& jt=const_cast<CJunc&>(*ins.first); //only non-key fields are updated
+		if (ins.second) jqueue.push(&jt);
+		else jt.add(j);
+	}
+
+	void addRead(GSamRecord& r, int dupcount) {
+		char strand = r.spliceStrand();
+	//	if (strand!='+' && strand!='-') return; // TODO: should we output .?
+		for (int i=1;i<r.exons.Count();i++) {
+			CJunc j(r.refId(), r.exons[i-1].end+1, r.exons[i].start-1, strand,
+					dupcount, r.exons[i-1].len(), r.exons[i].len());
+			add(j);
+		}
+	}
+
+	//write (and discard) all junctions on tid starting before pos
+	// (every junction if tid<0)
+	void flush(FILE* f, sam_hdr_t* hdr, int tid=-1, int pos=0) {
+		while (!jqueue.empty()) {
+			CJunc* j=jqueue.top();
+			if (tid>=0 && j->tid==tid && j->start>=pos) break;
+			j->write(f, hdr->target_name[j->tid], ++numWritten, tophat);
+			jqueue.pop();
+			CJunc jkey(*j);
+			jset.erase(jkey);
+		}
+	}
+};
+
+//b_start MUST be passed 1-based
+inline void addCov(GSamRecord& r, int val, GVec<uint64_t>& bvec, int b_start) {
+    bam1_t* in_rec=r.get_b();
+    int pos=in_rec->core.pos; // 0-based
+    b_start--; //to make it 0-based
+    for (uint8_t c=0;c<in_rec->core.n_cigar;++c){
+        uint32_t *cigar_full=bam_get_cigar(in_rec);
+        int opcode=bam_cigar_op(cigar_full[c]);
+        int oplen=bam_cigar_oplen(cigar_full[c]);
+        switch(opcode){
+            case BAM_CINS: // no change in coverage and position
+                break;
+            case BAM_CDEL: // skip to the next position - no change in coverage
+                pos+=oplen;
+                break;
+            case BAM_CREF_SKIP: // skip to the next position - no change in coverage
+                pos+=oplen;
+                break;
+            case BAM_CSOFT_CLIP:
+                break;
+            case BAM_CMATCH: // base match - add coverage
+                for(int i=0;i<oplen;i++) {
+                    bvec[pos-b_start]+=val;
+                    pos++;
+                }
+                break;
+            default:
+                GError("ERROR: unknown opcode: %c from read: %s",bam_cigar_opchr(opcode),bam_get_qname(in_rec));
+        }
+    }
+}
+
+//keep the maximum value (e.g. YX) of the alignments covering each base
+//b_start MUST be passed 1-based
+inline void addMax(GSamRecord& r, uint32_t val, GVec<uint32_t>& bvec, int b_start) {
+    bam1_t* in_rec=r.get_b();
+    int pos=in_rec->core.pos; // 0-based
+    b_start--; //to make it 0-based
+    for (uint8_t c=0;c<in_rec->core.n_cigar;++c){
+        uint32_t *cigar_full=bam_get_cigar(in_rec);
+        int opcode=bam_cigar_op(cigar_full[c]);
+        int oplen=bam_cigar_oplen(cigar_full[c]);
+        switch(opcode){
+            case BAM_CINS: // no change in coverage and position
+                break;
+            case BAM_CDEL: // skip to the next position - no change in coverage
+                pos+=oplen;
+                break;
+            case BAM_CREF_SKIP: // skip to the next position - no change in coverage
+                pos+=oplen;
+                break;
+            case BAM_CSOFT_CLIP:
+                break;
+            case BAM_CMATCH: // base match
+                for(int i=0;i<oplen;i++) {
+                    if (bvec[pos-b_start]<val) bvec[pos-b_start]=val;
+                    pos++;
+                }
+                break;
+            default:
+                GError("ERROR: unknown opcode: %c from read: %s",bam_cigar_opchr(opcode),bam_get_qname(in_rec));
+        }
+    }
+}
+
+#endif /* TIEBRUSH_TCOV_H_ */
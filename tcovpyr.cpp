@@ -0,0 +1,250 @@
+#include "tcovpyr.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+const uint32_t TCovPyramidWriter::tierSizes[TCPYR_NUM_TIERS]={1000, 10000, 100000};
+
+static inline uint64_t tcpyr_align8(uint64_t v) { return (v+7) & ~((uint64_t)7); }
+
+TCovPyramidWriter::TCovPyramidWriter(const char* fn, sam_hdr_t* hdr):f(NULL), fname(NULL),
+		refs(), fpos(0), cur_tid(-1), runs() {
+	f=fopen(fn, "wb");
+	if (f==NULL) GError("Error creating file %s\n", fn);
+	fname=Gstrdup(fn);
+	int nrefs=sam_hdr_nref(hdr);
+	refs.resize(nrefs);
+	memset(refs.data(), 0, nrefs*sizeof(TCPyrRef));
+	uint64_t names_len=0;
+	for (int i=0;i<nrefs;i++) {
+		refs[i].name_offset=names_len;
+		refs[i].len=(uint32_t)sam_hdr_tid2len(hdr, i);
+		names_len+=strlen(sam_hdr_tid2name(hdr, i))+1;
+	}
+	//header and reference table are rewritten on close(), names go right after them
+	fpos=sizeof(TCPyrHeader)+nrefs*sizeof(TCPyrRef);
+	if (fseeko(f, fpos, SEEK_SET)!=0) GError("Error seeking in file %s\n", fname);
+	for (int i=0;i<nrefs;i++) {
+		const char* n=sam_hdr_tid2name(hdr, i);
+		writeData(n, strlen(n)+1);
+	}
+	uint64_t pad=tcpyr_align8(fpos)-fpos;
+	if (pad) {
+		char zeros[8]={0,0,0,0,0,0,0,0};
+		writeData(zeros, pad);
+	}
+}
+
+void TCovPyramidWriter::writeData(const void* data, size_t len) {
+	if (len==0) return;
+	if (fwrite(data, 1, len, f)!=len)
+		GError("Error writing to file %s\n", fname);
+	fpos+=len;
+}
+
+void TCovPyramidWriter::addBases(uint32_t start, uint32_t end, uint32_t cov, uint32_t samples) {
+	if (!runs.empty() && runs.back().end+1==start && runs.back().cov==cov
+			&& runs.back().samples==samples)
+		runs.back().end=end;
+	else {
+		TCPyrRun r={start, end, cov, samples};
+		runs.push_back(r);
+	}
+	for (int t=0;t<TCPYR_NUM_TIERS;t++) {
+		uint32_t bsize=tierSizes[t];
+		uint32_t s=start;
+		while (s<=end) { //split the run at bin boundaries
+			uint32_t b=(s-1)/bsize;
+			uint32_t e=(b+1)*bsize;
+			if (e>end) e=end;
+			if (bins[t].empty() || bins[t].back().bin!=b) {
+				TCPyrBin nb={0, b, 0, UINT32_MAX, 0, 0, 0};
+				bins[t].push_back(nb);
+			}
+			TCPyrBin& cb=bins[t].back();
+			cb.sum+=(uint64_t)cov*(e-s+1);
+			cb.ncov+=e-s+1;
+			if (cov<cb.min) cb.min=cov;
+			if (cov>cb.max) cb.max=cov;
+			if (samples>cb.smax) cb.smax=samples;
+			s=e+1;
+		}
+	}
+}
+
+void TCovPyramidWriter::addBundle(int tid, int b_start, GVec<uint64_t>& cov,
+		GVec<uint32_t>& samples) {
+	if (tid<0 || b_start<=0) return;
+	if (tid!=cur_tid) {
+		flushRef();
+		cur_tid=tid;
+	}
+	int i=0;
+	while (i<cov.Count()) {
+		uint64_t c=cov[i];
+		uint32_t smp=(i<samples.Count()) ? samples[i] : 0;
+		int j=i+1;
+		while (j<cov.Count() && cov[j]==c &&
+				((j<samples.Count()) ? samples[j] : 0)==smp) j++;
+		if (c!=0)
+			addBases(b_start+i, b_start+j-1, (c>UINT32_MAX) ? UINT32_MAX : (uint32_t)c, smp);
+		i=j;
+	}
+}
+
+void TCovPyramidWriter::flushRef() {
+	if (cur_tid<0) return;
+	TCPyrRef& ref=refs[cur_tid];
+	ref.runs_offset=fpos;
+	ref.num_runs=runs.size();
+	writeData(runs.data(), runs.size()*sizeof(TCPyrRun));
+	for (int t=0;t<TCPYR_NUM_TIERS;t++) {
+		for (uint i=0;i<bins[t].size();i++) {
+			TCPyrBin& b=bins[t][i];
+			uint64_t bstart=(uint64_t)b.bin*tierSizes[t];
+			uint64_t blen=tierSizes[t];
+			if (bstart+blen>ref.len) blen=ref.len-bstart;
+			if (b.ncov<blen) b.min=0; //some bases in this bin are not covered
+		}
+		ref.bins_offset[t]=fpos;
+		ref.num_bins[t]=bins[t].size();
+		writeData(bins[t].data(), bins[t].size()*sizeof(TCPyrBin));
+		bins[t].clear();
+	}
+	runs.clear();
+	cur_tid=-1;
+}
+
+void TCovPyramidWriter::close() {
+	if (f==NULL) return;
+	flushRef();
+	TCPyrHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, TCPYR_MAGIC, 8);
+	h.num_refs=refs.size();
+	h.num_tiers=TCPYR_NUM_TIERS;
+	for (int t=0;t<TCPYR_NUM_TIERS;t++) h.tier_bsize[t]=tierSizes[t];
+	h.names_offset=sizeof(TCPyrHeader)+refs.size()*sizeof(TCPyrRef);
+	if (fseeko(f, 0, SEEK_SET)!=0) GError("Error seeking in file %s\n", fname);
+	if (fwrite(&h, sizeof(h), 1, f)!=1 ||
+			(!refs.empty() && fwrite(refs.data(), sizeof(TCPyrRef), refs.size(), f)!=refs.size()))
+		GError("Error writing to file %s\n", fname);
+	fclose(f);
+	f=NULL;
+	GFREE(fname);
+}
+
+TCovPyramid::TCovPyramid(const char* fn):mdata(NULL), msize(0), hdr(NULL),
+		refs(NULL), names(NULL) {
+	int fd=open(fn, O_RDONLY);
+	if (fd<0) GError("Error: could not open coverage summary file %s\n", fn);
+	struct stat st;
+	if (fstat(fd, &st)!=0 || st.st_size<(off_t)sizeof(TCPyrHeader))
+		GError("Error: invalid coverage summary file %s\n", fn);
+	msize=st.st_size;
+	mdata=mmap(NULL, msize, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mdata==MAP_FAILED) GError("Error: could not mmap file %s\n", fn);
+	hdr=(const TCPyrHeader*)mdata;
+	if (memcmp(hdr->magic, TCPYR_MAGIC, 8)!=0 || hdr->num_tiers!=TCPYR_NUM_TIERS)
+		GError("Error: %s is not a tiecov coverage summary file!\n", fn);
+	//all the offsets and counts are checked against the file size, so that a
+	// truncated or corrupt file cannot make the queries read past its end
+	auto inFile=[&](uint64_t offset, uint64_t count, uint64_t recsize) {
+		return (offset<=msize && count<=(msize-offset)/recsize);
+	};
+	for (int t=0;t<TCPYR_NUM_TIERS;t++)
+		if (hdr->tier_bsize[t]==0) GError("Error: invalid coverage summary file %s\n", fn);
+	if (!inFile(sizeof(TCPyrHeader), hdr->num_refs, sizeof(TCPyrRef)) ||
+			hdr->names_offset<sizeof(TCPyrHeader)+(uint64_t)hdr->num_refs*sizeof(TCPyrRef) ||
+			hdr->names_offset>msize)
+		GError("Error: invalid coverage summary file %s\n", fn);
+	refs=(const TCPyrRef*)((const char*)mdata+sizeof(TCPyrHeader));
+	names=(const char*)mdata+hdr->names_offset;
+	uint64_t nsize=msize-hdr->names_offset; //names must end before the end of the file
+	for (uint32_t i=0;i<hdr->num_refs;i++) {
+		const TCPyrRef& ref=refs[i];
+		bool valid=(ref.name_offset<nsize && memchr(names+ref.name_offset, 0, nsize-ref.name_offset)!=NULL &&
+				inFile(ref.runs_offset, ref.num_runs, sizeof(TCPyrRun)));
+		for (int t=0;valid && t<TCPYR_NUM_TIERS;t++)
+			valid=inFile(ref.bins_offset[t], ref.num_bins[t], sizeof(TCPyrBin));
+		if (!valid) GError("Error: invalid coverage summary file %s (reference #%u)\n", fn, i+1);
+	}
+}
+
+TCovPyramid::~TCovPyramid() {
+	if (mdata!=NULL && mdata!=MAP_FAILED) munmap(mdata, msize);
+}
+
+int TCovPyramid::refId(const char* name) {
+	for (uint32_t i=0;i<hdr->num_refs;i++)
+		if (strcmp(names+refs[i].name_offset, name)==0) return i;
+	return -1;
+}
+
+void TCovPyramid::addRuns(const TCPyrRef& ref, uint32_t start, uint32_t end, TCPyrStats& st) {
+	const TCPyrRun* runs=(const TCPyrRun*)((const char*)mdata+ref.runs_offset);
+	//first run ending at or after start
+	uint32_t l=0, r=ref.num_runs;
+	while (l<r) {
+		uint32_t m=(l+r)>>1;
+		if (runs[m].end<start) l=m+1;
+		else r=m;
+	}
+	for (uint32_t i=l;i<ref.num_runs && runs[i].start<=end;i++) {
+		uint32_t s=GMAX(start, runs[i].start);
+		uint32_t e=GMIN(end, runs[i].end);
+		st.sum+=(uint64_t)runs[i].cov*(e-s+1);
+		st.ncov+=e-s+1;
+		if (runs[i].cov<st.min) st.min=runs[i].cov;
+		if (runs[i].cov>st.max) st.max=runs[i].cov;
+		if (runs[i].samples>st.smax) st.smax=runs[i].samples;
+	}
+}
+
+//use the coarsest tier for the bins fully inside start..end, finer tiers for the edges
+void TCovPyramid::addRange(const TCPyrRef& ref, int tier, uint32_t start, uint32_t end,
+		TCPyrStats& st) {
+	if (start>end) return;
+	if (tier<0) {
+		addRuns(ref, start, end, st);
+		return;
+	}
+	uint64_t bsize=hdr->tier_bsize[tier];
+	int64_t fb=(start-1+bsize-1)/bsize; //first bin starting at or after start
+	int64_t lb=(int64_t)(end/bsize)-1; //last bin ending at or before end
+	if (lb<fb) {
+		addRange(ref, tier-1, start, end, st);
+		return;
+	}
+	addRange(ref, tier-1, start, fb*bsize, st);
+	const TCPyrBin* bins=(const TCPyrBin*)((const char*)mdata+ref.bins_offset[tier]);
+	uint32_t l=0, r=ref.num_bins[tier];
+	while (l<r) {
+		uint32_t m=(l+r)>>1;
+		if ((int64_t)bins[m].bin<fb) l=m+1;
+		else r=m;
+	}
+	for (uint32_t i=l;i<ref.num_bins[tier] && (int64_t)bins[i].bin<=lb;i++) {
+		st.sum+=bins[i].sum;
+		st.ncov+=bins[i].ncov;
+		if (bins[i].min<st.min) st.min=bins[i].min;
+		if (bins[i].max>st.max) st.max=bins[i].max;
+		if (bins[i].smax>st.smax) st.smax=bins[i].smax;
+	}
+	addRange(ref, tier-1, (lb+1)*bsize+1, end, st);
+}
+
+bool TCovPyramid::query(int tid, uint32_t start, uint32_t end, TCPyrStats& st) {
+	if (tid<0 || tid>=(int)hdr->num_refs) return false;
+	const TCPyrRef& ref=refs[tid];
+	if (start<1) start=1;
+	if (end==0 || end>ref.len) end=ref.len;
+	if (start>end) return false;
+	st=TCPyrStats();
+	st.len=end-start+1;
+	addRange(ref, TCPYR_NUM_TIERS-1, start, end, st);
+	if (st.ncov<st.len) st.min=0;
+	return true;
+}
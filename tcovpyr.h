@@ -0,0 +1,109 @@
+#ifndef TIEBRUSH_TCOVPYR_H_
+#define TIEBRUSH_TCOVPYR_H_
+
+#include <vector>
+#include "GBase.h"
+#include "GVec.hh"
+#include "htslib/sam.h"
+
+// Precomputed multi-resolution coverage summary ("coverage pyramid") file.
+// Layout (all integers little-endian, every section 8-byte aligned):
+//   TCPyrHeader
+//   TCPyrRef[num_refs]        per reference: name, length and section offsets
+//   reference names           \0-terminated strings
+//   per reference: TCPyrRun[] base-level run-length coverage (no zero runs)
+//                  TCPyrBin[] for each tier (only bins with some coverage)
+// The file is meant to be mmap()ed and queried in place.
+
+#define TCPYR_MAGIC "TCPYR01"
+#define TCPYR_NUM_TIERS 3
+
+struct TCPyrHeader {
+	char magic[8];
+	uint32_t num_refs;
+	uint32_t num_tiers;
+	uint32_t tier_bsize[TCPYR_NUM_TIERS]; //bin sizes: 1kb, 10kb, 100kb
+	uint32_t reserved;
+	uint64_t names_offset;
+};
+
+struct TCPyrRef {
+	uint64_t name_offset; //relative to names_offset
+	uint64_t runs_offset;
+	uint64_t bins_offset[TCPYR_NUM_TIERS];
+	uint32_t len;
+	uint32_t num_runs;
+	uint32_t num_bins[TCPYR_NUM_TIERS];
+	uint32_t reserved;
+};
+
+struct TCPyrRun { //a stretch of bases with the same coverage and sample count (1-based, inclusive)
+	uint32_t start;
+	uint32_t end;
+	uint32_t cov; //sum of YC over the alignments covering these bases
+	uint32_t samples; //max YX of the alignments covering these bases
+};
+
+struct TCPyrBin {
+	uint64_t sum; //coverage sum over all bases in the bin
+	uint32_t bin; //bin index (bin i covers bases i*bsize+1 .. (i+1)*bsize)
+	uint32_t ncov; //number of bases with non-zero coverage
+	uint32_t min; //min coverage (0 unless all bases are covered)
+	uint32_t max;
+	uint32_t smax; //max sample count
+	uint32_t reserved;
+};
+
+struct TCPyrStats { //query result for a window
+	uint64_t len;
+	uint64_t sum;
+	uint64_t ncov;
+	uint32_t min;
+	uint32_t max;
+	uint32_t smax;
+	TCPyrStats():len(0), sum(0), ncov(0), min(UINT32_MAX), max(0), smax(0) { }
+	double mean() { return len ? (double)sum/(double)len : 0; }
+};
+
+//builds the pyramid file while tiecov walks the coverage bundles
+class TCovPyramidWriter {
+	FILE* f;
+	char* fname;
+	std::vector<TCPyrRef> refs;
+	uint64_t fpos; //current end of data
+	int cur_tid;
+	std::vector<TCPyrRun> runs;
+	std::vector<TCPyrBin> bins[TCPYR_NUM_TIERS];
+	void addBases(uint32_t start, uint32_t end, uint32_t cov, uint32_t samples);
+	void flushRef();
+	void writeData(const void* data, size_t len);
+ public:
+	static const uint32_t tierSizes[TCPYR_NUM_TIERS];
+	TCovPyramidWriter(const char* fn, sam_hdr_t* hdr);
+	~TCovPyramidWriter() { close(); }
+	//add a coverage bundle; cov and samples are per-base values starting at 1-based b_start
+	void addBundle(int tid, int b_start, GVec<uint64_t>& cov, GVec<uint32_t>& samples);
+	void close();
+};
+
+//read-only, mmap()ed pyramid file
+class TCovPyramid {
+	void* mdata;
+	size_t msize;
+	const TCPyrHeader* hdr;
+	const TCPyrRef* refs;
+	const char* names;
+	void addRuns(const TCPyrRef& ref, uint32_t start, uint32_t end, TCPyrStats& st);
+	void addRange(const TCPyrRef& ref, int tier, uint32_t start, uint32_t end, TCPyrStats& st);
+ public:
+	TCovPyramid(const char* fn);
+	~TCovPyramid();
+	int numRefs() { return hdr->num_refs; }
+	const char* refName(int tid) { return names+refs[tid].name_offset; }
+	uint32_t refLen(int tid) { return refs[tid].len; }
+	int refId(const char* name);
+	//summary of coverage over 1-based window start..end on reference tid
+	bool query(int tid, uint32_t start, uint32_t end, TCPyrStats& st);
+};
+
+#endif /* TIEBRUSH_TCOVPYR_H_ */
@@ -26,6 +26,26 @@ diff_check () {
  fi
 }
 
+# BedGraph lines of file $1 clipped to the 0-based interval $3-$4 on $2
+bg_region () {
+ awk -v c=$2 -v s=$3 -v e=$4 '$1==c && $3>s && $2<e {
+   a=($2<s)?s:$2; b=($3>e)?e:$3; print $1"\t"a"\t"b"\t"$4 }' $1
+}
+
+# coverage sum (bases x value) of the BedGraph file $1 over the 0-based interval $3-$4 on $2
+bg_sum () {
+ bg_region $1 $2 $3 $4 | awk '{ s+=($3-$2)*$4 } END { printf "%.0f\n", s }'
+}
+
+val_check () {
+ if [[ "$2" == "$3" ]]; then
+   echo "OK ($1)"
+ else
+   echo "Error: test failed ($1: $2 != $3)"
+   exit 1
+ fi
+}
+
 ../tiebrush -o t1/tst_t1.bam t1/t1s[0-9].bam
 diff_check t1/tst_t1.bam t1/t1.bam
 
@@ -44,3 +64,134 @@ diff_check t1/tst_t1.junctions.bed t1/t1.junctions.bed
 diff_check t2/tst_t2.sample.bedgraph t2/t2.sample.bedgraph
 diff_check t2/tst_t2.coverage.bedgraph t2/t2.coverage.bedgraph
 diff_check t2/tst_t2.junctions.bed t2/t2.junctions.bed
+
+# TopHat-style junctions (--tophat) have the same junction coordinates and counts
+../tiecov --tophat -j t1/tst_t1.tophat t1/t1.bam
+awk 'NR==1 { print; next } { split($11, bl, ","); split($12, bo, ",");
+  print $1"\t"$2+bl[1]"\t"$2+bo[2]"\t"$4"\t"$5"\t"$6 }' t1/tst_t1.tophat.bed > t1/tst_t1.tophat.junctions.bed
+diff_check t1/tst_t1.tophat.junctions.bed t1/t1.junctions.bed
+
+# coverage for a region (-r) is the full coverage clipped to that region
+cp t1/t1.bam tst_t1i.bam
+samtools index tst_t1i.bam
+../tiecov -c tst_t1r.coverage -r chr12:98595000-98600000 tst_t1i.bam
+(head -1 t1/t1.coverage.bedgraph; bg_region t1/t1.coverage.bedgraph chr12 98594999 98600000) > tst_t1r.expected.bedgraph
+diff_check tst_t1r.coverage.bedgraph tst_t1r.expected.bedgraph
+
+# a window query on the coverage summary file (-p, --query) gives the coverage sum
+../tiecov -p tst_t1.tcp t1/t1.bam
+qsum=$(../tiecov --query=tst_t1.tcp chr12:98595000-98600000 | awk '!/^#/ { print $5 }')
+val_check "--query" $(bg_sum t1/t1.coverage.bedgraph chr12 98594999 98600000) "$qsum"
+
+# a COV request to the query server (--serve) gives the coverage sum
+../tiecov --serve=tst_srv.sock tst_t1i.bam &
+srvpid=$!
+for i in $(seq 100); do
+  [[ -S tst_srv.sock ]] && break
+  sleep 0.1
+done
+ssum=$(python3 - tst_srv.sock chr12:98595000-98600000 <<'PYEOF'
+import socket, sys
+s=socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+s.connect(sys.argv[1])
+f=s.makefile('rw')
+f.write('COV %s\n' % sys.argv[2])
+f.flush()
+for line in f:
+  if line.strip()=='END': break
+  print(line.split('\t')[4])
+f.write('SHUTDOWN\n')
+f.flush()
+PYEOF
+)
+wait $srvpid
+val_check "--serve" $(bg_sum t1/t1.coverage.bedgraph chr12 98594999 98600000) "$ssum"
+
+# the per-strand coverage tracks (--stranded) add up to the total coverage
+../tiecov --stranded -c tst_t1s.coverage t1/t1.bam
+ssum=$(cat tst_t1s.coverage.{plus,minus,unstranded}.bedgraph | awk '!/^track/ { s+=($3-$2)*$4 } END { printf "%.0f\n", s }')
+val_check "--stranded" $(awk '!/^track/ { s+=($3-$2)*$4 } END { printf "%.0f\n", s }' t1/t1.coverage.bedgraph) "$ssum"
+
+# merging in several levels (--max-open) gives the same records as a single pass
+../tiebrush -o tst_t12s.bam t1/t1s[0-9].bam t2/t2s[0-9].bam
+../tiebrush --max-open=3 -o tst_t12m.bam t1/t1s[0-9].bam t2/t2s[0-9].bam
+diff_check tst_t12s.bam tst_t12m.bam
+
+# outputs with a sample registry sidecar (--sample-registry) can be merged further
+../tiebrush --sample-registry -o tst_t1r.bam t1/t1s[0-9].bam
+diff_check tst_t1r.bam t1/t1.bam
+if [[ ! -f tst_t1r.bam.tbs ]]; then
+   echo "Error: test failed (no sample registry written for tst_t1r.bam)"
+   exit 1
+fi
+../tiebrush -o tst_t1rt2.bam tst_t1r.bam t2/tst_t2.bam
+diff_check tst_t1rt2.bam t12.bam
+../tiecov -s tst_t1r.sample tst_t1r.bam
+diff_check tst_t1r.sample.bedgraph t1/t1.sample.bedgraph
+
+# several outputs (-o) from one pass are the same as separate runs
+../tiebrush -E -o tst_t1e.bam t1/t1s[0-9].bam
+../tiebrush -L -o tst_t1f.bam t1/t1s[0-9].bam
+../tiebrush -o tst_t1o1.bam -o exon:tst_t1o2.bam -o full:tst_t1o3.bam t1/t1s[0-9].bam
+diff_check tst_t1o1.bam t1/t1.bam
+diff_check tst_t1o2.bam tst_t1e.bam
+diff_check tst_t1o3.bam tst_t1f.bam
+
+# the per-group outputs (--groups) of a single pass are the same as the group merges
+/bin/rm -f tst_groups.txt
+for f in t1/t1s[0-9].bam; do echo "$f t1" >> tst_groups.txt; done
+for f in t2/t2s[0-9].bam; do echo "$f t2" >> tst_groups.txt; done
+../tiebrush --groups=tst_groups.txt -o tst_grp.bam
+diff_check tst_grp.t1.bam t1/t1.bam
+diff_check tst_grp.t2.bam t2/t2.bam
+
+# the per-group tags (--group-tags) give the group coverage tracks (tiecov --groups)
+../tiebrush --groups=tst_groups.txt --group-tags -o tst_gtag.bam
+if ! samtools view -H tst_gtag.bam | grep -q $'^@CO\tGROUPS:t1,t2$'; then
+   echo "Error: test failed (no GROUPS header line in tst_gtag.bam)"
+   exit 1
+fi
+if ! samtools view tst_gtag.bam | grep -q $'\tYG:B:'; then
+   echo "Error: test failed (no YG tags in tst_gtag.bam)"
+   exit 1
+fi
+../tiecov --groups -c tst_gtag.coverage tst_gtag.bam
+tail -n +2 tst_gtag.coverage.t1.bedgraph > tst_gtag.t1.bedgraph
+tail -n +2 t1/t1.coverage.bedgraph > tst_t1.nohdr.bedgraph
+diff_check tst_gtag.t1.bedgraph tst_t1.nohdr.bedgraph
+tail -n +2 tst_gtag.coverage.t2.bedgraph > tst_gtag.t2.bedgraph
+tail -n +2 t2/t2.coverage.bedgraph > tst_t2.nohdr.bedgraph
+diff_check tst_gtag.t2.bedgraph tst_t2.nohdr.bedgraph
+
+# name-sorted inputs sorted internally (--sort) give the same merge
+samtools sort -n -o tst_n1.bam t1/t1.bam
+samtools sort -n -o tst_n2.bam t2/t2.bam
+../tiebrush --sort --sort-mem=1 -o tst_t12sort.bam tst_n1.bam tst_n2.bam
+diff_check tst_t12sort.bam t12.bam
+
+# adding samples to an existing output (--update) is the same as merging them with it
+../tiebrush -o tst_t1t2.bam t1/tst_t1.bam t2/t2s[0-9].bam
+../tiebrush --update=t1/tst_t1.bam -o tst_t1upd.bam t2/t2s[0-9].bam
+diff_check tst_t1t2.bam tst_t1upd.bam
+
+# a run killed after its first checkpoint (at the start of the second reference)
+# and then resumed gives the same records as an uninterrupted run; the output
+# file size limit keeps the small test run from finishing before it is killed
+fsz=$(( $(stat -c %s tst_t12s.bam)*8/10/1024 ))
+( ulimit -f $fsz; exec ../tiebrush --checkpoint=0 -o tst_ckpt.bam t1/t1s[0-9].bam t2/t2s[0-9].bam 2>/dev/null ) &
+ckpid=$!
+while kill -0 $ckpid 2>/dev/null && [[ ! -f tst_ckpt.bam.tbckpt ]]; do sleep 0.01; done
+kill -9 $ckpid 2>/dev/null
+wait $ckpid 2>/dev/null
+if [[ ! -f tst_ckpt.bam.tbckpt ]]; then
+   echo "Error: test failed (no checkpoint saved for tst_ckpt.bam)"
+   exit 1
+fi
+../tiebrush --resume -o tst_ckpt.bam t1/t1s[0-9].bam t2/t2s[0-9].bam
+diff_check tst_t12s.bam tst_ckpt.bam
+
+# the concatenated shard outputs (--shard, --concat) match the unsharded output
+../tiebrush --shard=1/2 -o tst_sh1.bam t1/t1s[0-9].bam t2/t2s[0-9].bam
+../tiebrush --shard=2/2 -o tst_sh2.bam t1/t1s[0-9].bam t2/t2s[0-9].bam
+../tiebrush --concat -o tst_shc.bam tst_sh1.bam tst_sh2.bam
+diff_check tst_t12s.bam tst_shc.bam
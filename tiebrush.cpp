@@ -1,12 +1,20 @@
 #include <vector>
+#include <map>
 #include <cstring>
 #include <stdlib.h>
 #include <iostream>
 #include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/resource.h>
 
 #include "commons.h"
 #include "GSam.h"
 #include "tmerge.h"
+#include "tshard.h"
+#include "tstats.h"
+#include "tbrush.h"
+#include "tmemacct.h"
 #include "GArgs.h"
 #include "GBitVec.h"
 
@@ -30,7 +38,9 @@ const char* USAGE = "TieBrush v" VERSION "\n"
                               "       \t\t\tfilenames, one per line\n"
                               "\n"
                               " Required arguments:\n"
-                              "  -o\t\t\tFile for BAM output\n"
+                              "  -o\t\t\tFile for BAM output; can be given multiple times, each\n"
+                              "    \t\t\tprefixed by its own merge strategy (cigar:, full:, clip:\n"
+                              "    \t\t\tor exon:), to produce all the outputs in a single pass\n"
                               "\n"
                               " Optional arguments:\n"
                               "  -h,--help\t\tShow this help message and exit\n"
@@ -62,7 +72,56 @@ const char* USAGE = "TieBrush v" VERSION "\n"
                               "  -N\t\t\tMaximum NH score of the reads to retain\n"
                               "  -Q\t\t\tMinimum mapping quality of the reads to retain\n"
                               "  -F\t\t\tBits in SAM flag to use in read comparison. Only reads that\n"
-                              "    \t\t\thave specified flags will be merged together (default: 0)\n";
+                              "    \t\t\thave specified flags will be merged together (default: 0)\n"
+                              "  -t\t\t\tNumber of threads used to open the input files,\n"
+                              "    \t\t\tload their headers and compress the output (default: 4)\n"
+                              "  --sample-registry\tWrite the list of samples to a binary sidecar\n"
+                              "                   \tfile (<output>.tbs) referenced by a single\n"
+                              "                   \theader line, instead of one @CO line per sample\n"
+                              "  --groups\t\tFile with <input file> <group name> pairs, one per line;\n"
+                              "          \t\tfor each group, <output>.<group>.bam is also written,\n"
+                              "          \t\twith the alignments and counts of that group's files\n"
+                              "          \t\t(if no input files are given, those listed are used)\n"
+                              "  --group-tags\tInstead of per-group files, add the per-group\n"
+                              "              \tmultiplicity (YG:B:I) and sample counts (YS:B:I)\n"
+                              "              \tto the output alignments, in the order of the\n"
+                              "              \t@CO GROUPS: header line; inputs with such tags\n"
+                              "              \tkeep their groups\n"
+                              "  --sort\t\tAccept inputs that are not coordinate-sorted (e.g.\n"
+                              "        \t\tunsorted or name-sorted aligner output) and sort\n"
+                              "        \t\tthem internally, spilling compressed sorted runs\n"
+                              "        \t\tto temporary files that are merged directly\n"
+                              "  --sort-mem\t\tMemory for sorting, in MB (default: 1024)\n"
+                              "  --tmp-dir\t\tDirectory for the sorted runs (default: the\n"
+                              "           \t\tdirectory of the output file)\n"
+                              "  --update\t\tExisting TieBrush output to add the input files to;\n"
+                              "          \t\tits alignments are copied unchanged where no input\n"
+                              "          \t\thas alignments starting at the same position\n"
+                              "  --checkpoint\tSave the merge state to <output>.tbckpt at\n"
+                              "              \tchromosome boundaries, at most once every given\n"
+                              "              \tnumber of seconds (0: at every chromosome)\n"
+                              "  --resume\t\tContinue an interrupted run from its checkpoint\n"
+                              "          \t\t(same options and files), appending to the outputs\n"
+                              "  --shard\t\tOnly merge shard i of N (given as i/N, 1-based) of\n"
+                              "         \t\tthe references, partitioned by length; the shard\n"
+                              "         \t\toutputs are joined with --concat\n"
+                              "  --concat\t\tConcatenate the shard outputs given as input files\n"
+                              "          \t\tinto the -o file, without recompressing them\n"
+                              "  --index\t\tWith --concat, also write the .bai index\n"
+                              "  --stats\t\tWrite a JSON report of the time spent in each\n"
+                              "         \t\tprocessing stage, input throughput and bundle\n"
+                              "         \t\tsizes to this file (updated every minute)\n"
+                              "  --progress\tReport the progress (input bytes read, rate,\n"
+                              "            \testimated time left) every given number of seconds\n"
+                              "  --hot-loci\tWrite the alignment start positions with the most\n"
+                              "            \tinput records, collapsed alignments, comparisons\n"
+                              "            \tor merge time to this TSV file\n"
+                              "  --hot-top\tNumber of positions kept for each of these\n"
+                              "           \t(default: 20)\n"
+                              "  --max-open\t\tMaximum number of input files to merge in one pass;\n"
+                              "            \t\tlarger input sets are merged in groups through\n"
+                              "            \t\ttemporary files (default: derived from the open\n"
+                              "            \t\tfiles limit, at most 1000)\n";
 
 // 1. add mode to select representative alignment
 // 2. add mode to select consensus sequence
@@ -71,13 +130,6 @@ const char* USAGE = "TieBrush v" VERSION "\n"
 // 5. in the help indicate what options are default
 // 6. fix PG/RG sample confusion
 
-enum TMrgStrategy {
-	tMrgStratCIGAR=0,  // same CIGAR (MD may differ)
-	tMrgStratFull, // same CIGAR and MD
-	tMrgStratClip,   // same CIGAR after clipping
-	tMrgStratExon    // same exons
-};
-
 struct Options{
     int max_nh = MAX_INT;
     int min_qual = -1;
@@ -88,252 +140,53 @@ struct Options{
 
 TMrgStrategy mrgStrategy=tMrgStratCIGAR;
 TInputFiles inRecords;
+int numInputs=0; //number of inputs in the current merge pass
+int maxOpenFiles=0; //max number of inputs merged in one pass (0: derived from the fd limit)
+bool useSampleRegistry=false; //write the sample list to a sidecar file (<output>.tbs)
+
+//sample groups (--groups manifest): each group also gets its own output file
+GStr groupsfname;
+GVec<GStr> groupNames;
+GVec<int> inputGroup; //group index of each input file (-1 if not in any group)
+int numGroups=0;
+std::map<std::string, int> fileGroups; //full input path -> group index (from the manifest)
+//--group-tags: per-group counts go to YG/YS tags of the main output instead
+bool groupTags=false;
+//for each input of the current merge pass with its own per-group tags,
+// the output group index of each of its groups
+std::vector< std::vector<int> > inputGroupMap;
+bool inputGroupTags=false; //some inputs of the current pass have per-group tags
+GVec<int64_t> groupTagVals; //buffer for reading the per-group tags
 
-GStr outfname;
-GSamWriter* outfile=NULL;
+GStr outfname; //first (or only) output file
+GStr basefname; //--update: existing TieBrush output the inputs are added to
+int checkpointSecs=-1; //--checkpoint: min. seconds between checkpoints (-1: no checkpoints)
+bool resumeRun=false; //--resume: continue from the last checkpoint, if any
+bool concatShards=false; //--concat: join the outputs of a sharded run
+bool indexOutput=false; //--index: write the .bai index of the --concat output
+int progressSecs=0; //--progress: seconds between progress reports
+TProgress* progress=NULL;
+GStr hotLociFname; //--hot-loci: report of the most expensive positions
+int hotLociTop=20; //--hot-top: positions kept for each ranking
+THotLoci* hotLoci=NULL;
+uint64_t spdCompares=0; //SPData comparisons, for the hot-locus report
 
 uint64_t inCounter=0;
-uint64_t outCounter=0;
 
 bool verbose=false;
 
-struct GSegNode {
-	GSeg seg;
-	GSegNode* next;
-	inline uint start() { return seg.start; }
-	inline uint end() { return seg.end; }
-	GSegNode(uint segstart=0, uint segend=0, GSegNode* nnext=NULL):seg(segstart, segend),
-			next(nnext) {}
-	GSegNode(GSeg& exon, GSegNode* nnext=NULL):seg(exon),
-			next(nnext) {}
+//counts for the subset of the merged alignments coming from one sample group,
+// the same as a separate TieBrush run on that group's files would produce
+struct SPGroupData {
+	GSamRecord* r; //first alignment from this group (NULL if none)
+	int64_t accYC;
+	int64_t accYX;
+	int64_t maxYD;
+	int dupCount;
+	SPGroupData():r(NULL), accYC(0), accYX(0), maxYD(0), dupCount(0) { }
+	~SPGroupData() { delete r; }
 };
 
-struct GSegList { //per sample per strand
-  GSegNode* startNode;
-  uint last_pos;
-  int last_dist;
-  GSegList():startNode(NULL),last_pos(0),last_dist(-1) { }
-
-  ~GSegList() {
-	  clear();
-  }
-
-  void reset() {
-	  clear();
-	  last_pos=0;
-	  last_dist=-1;
-	  //startNode=new GSegNode();
-	  startNode=NULL;
-  }
-
-  void clear() { //delete all nodes
-	  GSegNode* p=startNode;
-	  GSegNode* next;
-	  while (p) {
-		  next=p->next;
-		  delete p;
-		  p=next;
-	  }
-	  startNode=NULL;
-  }
-
-  void clearTo(GSegNode* toNode) {
-	  //clear every node up to and *including* toNode
-	  GSegNode* p=startNode;
-	  GSegNode* next;
-	  while (p && p!=toNode) {
-		  next=p->next;
-		  delete p;
-		  p=next;
-	  }
-	  if (p==NULL) GError("Error: clearTo did not find target node %d-%d!\n",
-			  toNode->start(), toNode->end());
-	  next=toNode->next;
-	  delete toNode;
-	  startNode=next;
-  }
-
- void mergeRead(GSamRecord& r) {
-	 if (startNode==NULL) {
-		 startNode=new GSegNode(r.exons[0]);
-		 GSegNode* cn=startNode;
-		 for (int i=1;i<r.exons.Count();i++){
-			 GSegNode* n=new GSegNode(r.exons[i]);
-			 cn->next=n;
-			 cn=n;
-		 }
-		 return;
-	 }
-	 GSegNode *n=startNode;
-	 GSegNode *prev=NULL;
-	 for (int i=0;i<r.exons.Count();i++) {
-		 GSeg& e=r.exons[i];
-		 while (n) {
-            if (e.end < n->start()) {
-              //exon should be inserted before n!
-              GSegNode* nw=new GSegNode(e, n);
-              if (n==startNode)
-            	startNode=nw;
-              else
-                prev->next=nw;
-              //n is unchanged
-          	  prev=nw;
-              break; //check next exon against n
-            }
-            // e.end >= node start
-            if (e.start <= n->end()) { //overlap!
-              //union should replace/change n
-              if (e.start<n->start()) n->seg.start=e.start;
-              if (e.end>n->end()) n->seg.end=e.end;
-              //we have to check if next nodes are now overlapped as well
-              GSegNode* next=n->next;
-              while (next && next->start()<=n->end()) {
-            	  //overlap, swallow this next node
-            	  uint nend=next->end();
-            	  n->next=next->next;
-            	  delete next;
-            	  next=n->next;
-                  if (nend>n->end()) {
-                	n->seg.end=nend;
-                	break; //there cannot be overlap with next node
-                  }
-              } //while overlap with next nodes
-              break; //check next exon against this extended n
-            }
-            // e.start > node end
-            prev=n;
-            n=n->next;
-		 }
-	 }
- }
-
- int processRead(GSamRecord& r) { //return d=current bundle extent upstream
-	 //if the read starts after a gap, d=0
-	 //this should only be called ONCE per collapsed read and sample
-	 //should NOT be called on reads coming from already merged samples!
-	 if (last_pos==r.start) { //already called on the same sample and start position
-	     mergeRead(r);
-		 return last_dist;
-	 }
-	 int d=0;
-	 GSegNode* node=startNode;
-	 GSegNode* prev=NULL;
-	 while (node && node->start()< r.start) {
-		 prev=node;
-		 node=node->next;
-	 }
-	 //prev is the last segment starting before r
-	 if (prev) {
-		 if (prev->end()>=r.start)  // r overlaps prev segment
-			d=r.start - prev->start();
-		 if (d==0)
-			clearTo(prev); //clear all nodes including prev
-	 }
-
-     if (last_pos!=r.start) {
-    	 last_pos=r.start;
-    	 last_dist=d;
-     }
-     mergeRead(r);
-	 return d;
- }
-
-
-};
-
-
-struct RDistanceData {
-  GVec<GSegList> fsegs; //forward strand segs for each sample
-  GVec<GSegList> rsegs; //reverse strand segs for each sample
-  void init(int num_samples) {
-	  fsegs.Resize(num_samples);
-	  rsegs.Resize(num_samples);
-	  this->reset();
-  }
-  void reset() {
-	  for (int i=0;i<fsegs.Count();i++) {
-           fsegs[i].reset();
-           rsegs[i].reset();
-	  }
-  }
-};
-
-RDistanceData rspacing;
-
-// check the two reads for compatibility with user provided flags
-int cmpFlags(GSamRecord& a, GSamRecord& b){
-    if(options.flags == 0){
-        return 0;
-    }
-    if((options.flags & a.get_b()->core.flag) == (options.flags & b.get_b()->core.flag)){ // make sure the user-requested flags are the same between reads
-        return 0;
-    }
-    return 1;
-}
-
-int cmpFull(GSamRecord& a, GSamRecord& b) {
-    //-- Flags
-    bool cmp_flag = cmpFlags(a,b);
-    if(cmp_flag!=0) return cmp_flag;
-	//-- CIGAR && MD strings
-	if (a.get_b()->core.n_cigar!=b.get_b()->core.n_cigar) return ((int)a.get_b()->core.n_cigar - (int)b.get_b()->core.n_cigar);
-	int cigar_cmp=0;
-	if (a.get_b()->core.n_cigar>0)
-		cigar_cmp=memcmp(bam_get_cigar(a.get_b()) , bam_get_cigar(b.get_b()), a.get_b()->core.n_cigar*sizeof(uint32_t) );
-	if (cigar_cmp!=0) return cigar_cmp;
-	// compare MD tag
-	char* aMD=a.tag_str("MD");
-	char* bMD=b.tag_str("MD");
-	if (aMD==NULL || bMD==NULL) {
-		if (aMD==bMD) return 0;
-		if (aMD!=NULL) return 1;
-		return -1;
-	}
-    return strcmp(aMD, bMD);
-}
-
-int cmpCigar(GSamRecord& a, GSamRecord& b) {
-    bool cmp_flag = cmpFlags(a,b);
-    if(cmp_flag!=0) return cmp_flag;
-	if (a.get_b()->core.n_cigar!=b.get_b()->core.n_cigar) return ((int)a.get_b()->core.n_cigar - (int)b.get_b()->core.n_cigar);
-	if (a.get_b()->core.n_cigar==0) return 0;
-	return memcmp(bam_get_cigar(a.get_b()) , bam_get_cigar(b.get_b()), a.get_b()->core.n_cigar*sizeof(uint32_t) );
-}
-
-int cmpCigarClip(GSamRecord& a, GSamRecord& b) {
-    bool cmp_flag = cmpFlags(a,b);
-    if(cmp_flag!=0) return cmp_flag;
-	uint32_t a_clen=a.get_b()->core.n_cigar;
-	uint32_t b_clen=b.get_b()->core.n_cigar;
-	uint32_t* a_cstart=bam_get_cigar(a.get_b());
-	uint32_t* b_cstart=bam_get_cigar(b.get_b());
-	while (a_clen>0 &&
-			((*a_cstart) & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) { a_cstart++; a_clen--; }
-	while (a_clen>0 &&
-			(a_cstart[a_clen-1] & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) a_clen--;
-	while (b_clen>0 &&
-			((*b_cstart) & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) { b_cstart++; b_clen--; }
-	while (b_clen>0 &&
-			(b_cstart[b_clen-1] & BAM_CIGAR_MASK)==BAM_CSOFT_CLIP) b_clen--;
-	if (a_clen!=b_clen) return (int)a_clen-(int)b_clen;
-	if (a_clen==0) return 0;
-	return memcmp(a_cstart, b_cstart, a_clen*sizeof(uint32_t));
-}
-
-int cmpExons(GSamRecord& a, GSamRecord& b) {
-    bool cmp_flag = cmpFlags(a,b);
-    if(cmp_flag!=0) return cmp_flag;
-	if (a.exons.Count()!=b.exons.Count()) return (a.exons.Count()-b.exons.Count());
-	for (int i=0;i<a.exons.Count();i++) {
-		if (a.exons[i].start!=b.exons[i].start)
-			return ((int)a.exons[i].start-(int)b.exons[i].start);
-		if (a.exons[i].end!=b.exons[i].end)
-			return ((int)a.exons[i].end-(int)b.exons[i].end);
-	}
-	return 0;
-}
-
-
 //keep track of all SAM alignments starting at the same coordinate
 // that were merged into a single alignment
 class SPData { // Same Point data
@@ -348,10 +201,17 @@ class SPData { // Same Point data
                                             // number of bits set will be stored as YX:i:(samples.count()+accYX)
 	int dupCount; //duplicity count - how many single-alignments were merged into r
 	              // will be stored as tag YC:i:(dupCount+accYC)
+	int tbCount; //how many records from TieBrush generated files were merged into r
 	GSamRecord* r;
 	char tstrand; //'-','+' or '.'
-    SPData(GSamRecord* rec=NULL):settled(false), accYC(0), accYX(0), maxYD(0),samples(NULL),
-    		dupCount(0), r(rec), tstrand('.') {
+	TMrgStrategy strategy; //how records are compared for merging
+	SPGroupData* gdata; //per-group counts, only when sample groups are given
+	int64_t* gYC; //per-group multiplicity, stored as YG:B:I (--group-tags only)
+	int64_t* gYX; //per-group sample counts of merged records, stored (with the
+	              // direct samples) as YS:B:I (--group-tags only)
+    SPData(GSamRecord* rec=NULL, TMrgStrategy strat=tMrgStratCIGAR):settled(false), accYC(0),
+    		accYX(0), maxYD(0),samples(NULL), dupCount(0), tbCount(0), r(rec), tstrand('.'), strategy(strat),
+    		gdata(NULL), gYC(NULL), gYX(NULL) {
     	if (r!=NULL) tstrand=r->spliceStrand();
     }
 
@@ -359,23 +219,94 @@ class SPData { // Same Point data
     	if (settled && r!=NULL) delete r;
     	if (samples!=NULL) delete samples;
         if (!sample_dupcounts.empty()) sample_dupcounts.clear();
+        delete[] gdata;
+        delete[] gYC;
+        delete[] gYX;
+    }
+
+    //update the per-group tag counts with record rec of input fidx;
+    // for direct samples, only called when dupCount is incremented
+    void groupTagAdd(GSamRecord& rec, int fidx, bool tbMerged) {
+    	int g=inputGroup[fidx];
+    	if (!tbMerged) {
+    		if (g>=0) gYC[g]++;
+    		return;
+    	}
+    	std::vector<int>& gmap=inputGroupMap[fidx];
+    	if (!gmap.empty()) { //brushed file with its own groups
+    		int n=rec.tag_int_array(TB_GROUP_COV_TAG, groupTagVals);
+    		for (int i=0;i<n && i<(int)gmap.size();i++) gYC[gmap[i]]+=groupTagVals[i];
+    		n=rec.tag_int_array(TB_GROUP_SMP_TAG, groupTagVals);
+    		for (int i=0;i<n && i<(int)gmap.size();i++) gYX[gmap[i]]+=groupTagVals[i];
+    	}
+    	else if (g>=0) { //the whole brushed file belongs to a group
+    		gYC[g]+=rec.tag_int("YC", 1);
+    		gYX[g]+=rec.tag_int("YX", 1);
+    	}
+    }
+
+    //update the counts of the group of input fidx with its record rec;
+    // must be called before samples is updated
+    void groupAdd(GSamRecord& rec, int fidx, bool tbMerged) {
+    	int g=inputGroup[fidx];
+    	if (g<0) return;
+    	SPGroupData& gd=gdata[g];
+    	if (gd.r==NULL) { //first record of this group, like settle()
+    		gd.r=new GSamRecord(rec);
+    		if (tbMerged) {
+    			gd.accYC=rec.tag_int("YC", 1);
+    			gd.accYX=rec.tag_int("YX", 1);
+    			gd.maxYD=rec.tag_int("YD", 0);
+    		}
+    		else gd.dupCount++;
+    		return;
+    	}
+    	//like dupAdd(), but against this group's own first record
+    	if (tbMerged) {
+    		gd.accYC+=rec.tag_int("YC",1);
+    		gd.accYX+=rec.tag_int("YX", 1);
+    		int64_t vYD=rec.tag_int("YD",0);
+    		if (vYD>gd.maxYD) gd.maxYD=vYD;
+    	}
+    	else if (!samples->test(fidx) || rec.pairOrder()!=gd.r->pairOrder() ||
+    			strcmp(gd.r->name(), rec.name())!=0)
+    		gd.dupCount++;
     }
 
     void detach(bool dontFree=true) { settled=!dontFree; }
     //detach(true) must never be called before settle()
 
-    void settle(TInputRecord& trec) { //becomes a standalone SPData record
-    	// duplicates the current record
+    void settle(TInputRecord& trec, bool copyRec=false) { //becomes a standalone SPData record
+    	// takes over the current record, or duplicates it if copyRec is set
+    	// (when the same input record is also needed by other outputs)
     	settled=true;
-    	trec.disown();
+    	if (copyRec) r=new GSamRecord(*trec.brec);
+    	else { //the input record is accounted to the SPData from now on
+    		trec.disown();
+    		tmem_retag(r, tmSPData);
+    		tmem_retag(r->get_b(), tmSPData);
+    		tmem_retag(r->get_b()->data, tmSPData);
+    	}
     	if (samples==NULL) {
-            samples = new GBitVec(inRecords.freaders.Count());
+            samples = new GBitVec(numInputs);
         }
         if (sample_dupcounts.empty()){
-            sample_dupcounts.assign(inRecords.freaders.Count(),0);
+            sample_dupcounts.assign(numInputs,0);
+        }
+        if (numGroups>0) {
+        	if (groupTags) {
+        		gYC=new int64_t[numGroups]();
+        		gYX=new int64_t[numGroups]();
+        		groupTagAdd(*r, trec.fidx, trec.tbMerged);
+        	}
+        	else {
+        		gdata=new SPGroupData[numGroups];
+        		groupAdd(*r, trec.fidx, trec.tbMerged);
+        	}
         }
 
     	if (trec.tbMerged) {
+    		tbCount=1;
     		accYC=r->tag_int("YC", 1);
     		accYX=r->tag_int("YX", 1);
     		maxYD=r->tag_int("YD", 0);
@@ -390,15 +321,19 @@ class SPData { // Same Point data
     	if (!settled) GError("Error: cannot merge a duplicate into a non-settled SP record!\n");
     	GSamRecord& rec=*trec.brec;
     	//WARNING: rec MUST be a "duplicate" of current record r
+    	if (gdata!=NULL) groupAdd(rec, trec.fidx, trec.tbMerged);
     	if (trec.tbMerged) {
+    		tbCount++;
     		accYC+=rec.tag_int("YC",1);
     		accYX+=rec.tag_int("YX", 1);
     		int64_t vYD=rec.tag_int("YD",0);
     		if (vYD>maxYD) maxYD=vYD; //keep only maximum YD value
+    		if (gYC!=NULL) groupTagAdd(rec, trec.fidx, true);
     	} else {
     		//avoid collapsing same read alignment duplicated just for pairing reasons
     		if (!samples->test(trec.fidx) || rec.pairOrder()!=r->pairOrder() ||
     				strcmp(r->name(), rec.name())!=0) {
+    		   if (gYC!=NULL) groupTagAdd(rec, trec.fidx, false);
     		   dupCount++;
     		   samples->set(trec.fidx);
     		   sample_dupcounts[trec.fidx]++;
@@ -408,46 +343,48 @@ class SPData { // Same Point data
 
     bool operator<(const SPData& b) {
     	if (r==NULL || b.r==NULL) GError("Error: cannot compare uninitialized SAM records\n");
-    	if (r->refId()!=b.r->refId()) return (r->refId()<b.r->refId());
-    	//NOTE: already assuming that start&end must match, no matter the merge strategy
-    	if (r->start!=b.r->start) return (r->start<b.r->start);
-    	if (tstrand!=b.tstrand) return (tstrand<b.tstrand);
-    	if (r->end!=b.r->end) return (r->end<b.r->end);
-    	if (mrgStrategy==tMrgStratFull) {
-    		int ret=cmpFull(*r, *(b.r));
-    		return (ret<0);
-    	}
-    	else
-    		switch (mrgStrategy) {
-    		  case tMrgStratCIGAR: return (cmpCigar(*r, *(b.r))<0); break;
-    		  case tMrgStratClip: return (cmpCigarClip(*r, *(b.r))<0); break;
-    		  case tMrgStratExon: return (cmpExons(*r, *(b.r))<0); break;
-    		  default: GError("Error: unknown merge strategy!\n");
-    		}
-    	return false;
+    	spdCompares++;
+    	return (cmpMergeKey(*r, tstrand, *(b.r), b.tstrand, strategy, options.flags)<0);
     }
 
     bool operator==(const SPData& b) {
     	if (r==NULL || b.r==NULL) GError("Error: cannot compare uninitialized SAM records\n");
-    	if (r->refId()!=b.r->refId() || r->start!=b.r->start || tstrand!=b.tstrand ||
-    			r->end!=b.r->end) return false;
-    	if (mrgStrategy==tMrgStratFull) return (cmpFull(*r, *(b.r))==0);
-    	else
-    		switch (mrgStrategy) {
-    		  case tMrgStratCIGAR: return (cmpCigar(*r, *(b.r))==0); break;
-    		  case tMrgStratClip: return (cmpCigarClip(*r, *(b.r))==0); break;
-    		  case tMrgStratExon: return (cmpExons(*r, *(b.r))==0); break;
-    		  default: GError("Error: unknown merge strategy!\n");
-    		}
-    	return false;
+    	spdCompares++;
+    	return (cmpMergeKey(*r, tstrand, *(b.r), b.tstrand, strategy, options.flags)==0);
     }
 };
 
+//an output file with its own merge strategy and grouping state
+struct TBrushOutput {
+	TMrgStrategy strategy;
+	GStr fname;
+	GSamWriter* writer;
+	RDistanceData rspacing;
+	GList<SPData> spdata; //list of Same Position data, with all possibly merged records
+	uint64_t outCounter;
+	GPVec<GSamWriter> gwriters; //output for each sample group
+	TBrushOutput(TMrgStrategy strat, const char* fn):strategy(strat), fname(fn), writer(NULL),
+			rspacing(), spdata(true, true, true), outCounter(0), gwriters(true) { }
+	~TBrushOutput() { delete writer; }
+	GStr groupFileName(int g) { //<output>.<group>.bam
+		GStr gfn(fname);
+		if (gfn.endsWith(".bam")) gfn.cut(gfn.length()-4);
+		gfn.append('.');
+		gfn.append(groupNames[g]);
+		gfn.append(".bam");
+		return gfn;
+	}
+};
+
+GPVec<TBrushOutput> brushOutputs(true); //all the -o outputs, in the order given
+
 void processOptions(int argc, char* argv[]);
 
-void addPData(TInputRecord& irec, GList<SPData>& spdlst) {
+void addPData(TInputRecord& irec, TBrushOutput& out, bool copyRec) {
   //add and collapse if match found
-	SPData* newspd=new SPData(irec.brec);
+	TMemScope ms(tmSPData);
+	GList<SPData>& spdlst=out.spdata;
+	SPData* newspd=new SPData(irec.brec, out.strategy);
 	if (spdlst.Count()>0) {
 		//find if irec can merge into existing SPData
 		SPData* spf=spdlst.AddIfNew(newspd, false);
@@ -466,14 +403,62 @@ void addPData(TInputRecord& irec, GList<SPData>& spdlst) {
 	else { // empty list, just add this
 		spdlst.Add(newspd);
 	}
-	newspd->settle(irec); //keep its own SAM record copy
+	newspd->settle(irec, copyRec); //keep its own SAM record copy
+}
+
+//store the per-group counts of spd as YG/YS array tags (or drop them if
+// this alignment has no group data)
+void setGroupTags(SPData& spd) {
+	static GVec<uint32_t> gcov, gsmp;
+	gcov.Clear();
+	gsmp.Clear();
+	bool any=false;
+	for (int g=0;g<numGroups;g++) {
+		uint32_t c=(spd.gYC[g]>UINT32_MAX) ? UINT32_MAX : (uint32_t)spd.gYC[g];
+		uint32_t x=(spd.gYX[g]>UINT32_MAX) ? UINT32_MAX : (uint32_t)spd.gYX[g];
+		if (c || x) any=true;
+		gcov.Add(c);
+		gsmp.Add(x);
+	}
+	if (any) {
+		spd.r->add_uint_array_tag(TB_GROUP_COV_TAG, numGroups, gcov());
+		spd.r->add_uint_array_tag(TB_GROUP_SMP_TAG, numGroups, gsmp());
+	}
+	else {
+		spd.r->remove_tag(TB_GROUP_COV_TAG);
+		spd.r->remove_tag(TB_GROUP_SMP_TAG);
+	}
 }
 
-void flushPData(GList<SPData>& spdlst){ //write spdata to outfile
+//write a record, timing the output encoding (--stats); returns the time taken
+template<class R> static inline uint64_t writeTimed(GSamWriter* w, R* r) {
+	TMemScope ms(tmOutput);
+	if (runStats==NULL) {
+		w->write(r);
+		return 0;
+	}
+	uint64_t t0=tstat_now();
+	w->write(r);
+	uint64_t ns=tstat_now()-t0;
+	runStats->addStage(tsEncode, ns);
+	return ns;
+}
+
+void flushPData(TBrushOutput& out){ //write spdata to the output file
+  GList<SPData>& spdlst=out.spdata;
   if (spdlst.Count()==0) return;
+  uint64_t t0=runStats ? tstat_now() : 0;
+  uint64_t encNs=0; //output encoding is reported separately
   // write SAM records in spdata to outfile
   for (int i=0;i<spdlst.Count();++i) {
 	  SPData& spd=*(spdlst.Get(i));
+	  if (spd.tbCount==1 && spd.dupCount==0 && spd.gdata==NULL && spd.gYC==NULL && !inputGroupTags) {
+		  //a single record of a TieBrush file with nothing merged into it:
+		  // its YC/YX/YD tags would not change, so it is written as it is
+		  encNs+=writeTimed(out.writer, spd.r);
+		  out.outCounter++;
+		  continue;
+	  }
 	  int64_t accYC=spd.accYC+spd.dupCount;
       if(spd.accYC+spd.dupCount > UINT32_MAX){ // set a cap to prevent overflow with SAM
           accYC = UINT32_MAX;
@@ -485,35 +470,72 @@ void flushPData(GList<SPData>& spdlst){ //write spdata to outfile
 	  if (accYX>1) spd.r->add_int_tag("YX", accYX);
 	  int dmax=spd.maxYD;
 	  for(int s=spd.samples->find_first();s>=0;s=spd.samples->find_next(s)) {
+	    	TMemScope ms(tmSpacing);
+	    	int sdmax=0;
 	    	if (spd.tstrand=='+' || spd.tstrand=='.') {
-	    	   int r=rspacing.fsegs[s].processRead(*spd.r);
-	    	   if (r>dmax) dmax=r;
+	    	   int r=out.rspacing.fwd(s).processRead(*spd.r);
+	    	   if (r>sdmax) sdmax=r;
 	    	}
 	    	if (spd.tstrand=='-' || spd.tstrand=='.') {
-	    	   int r=rspacing.rsegs[s].processRead(*spd.r);
-	    	   if (r>dmax) dmax=r;
+	    	   int r=out.rspacing.rev(s).processRead(*spd.r);
+	    	   if (r>sdmax) sdmax=r;
+	    	}
+	    	if (sdmax>dmax) dmax=sdmax;
+	    	if (spd.gdata!=NULL && inputGroup[s]>=0) { //direct sample of a group
+	    		SPGroupData& gd=spd.gdata[inputGroup[s]];
+	    		gd.accYX++;
+	    		if (sdmax>gd.maxYD) gd.maxYD=sdmax;
 	    	}
+	    	if (spd.gYX!=NULL && inputGroup[s]>=0) spd.gYX[inputGroup[s]]++;
 	  } //for each bit index/sample
 	  spd.maxYD=dmax;
 	  if (spd.maxYD>0) spd.r->add_int_tag("YD", spd.maxYD);
 	  else spd.r->remove_tag("YD");
-	  outfile->write(spd.r);
+	  if (spd.gYC!=NULL) setGroupTags(spd);
+	  else if (inputGroupTags) { //per-group tags from the inputs are not valid here
+		  spd.r->remove_tag(TB_GROUP_COV_TAG);
+		  spd.r->remove_tag(TB_GROUP_SMP_TAG);
+	  }
+	  encNs+=writeTimed(out.writer, spd.r);
 
-	  outCounter++;
+	  out.outCounter++;
+	  if (spd.gdata!=NULL) {
+	  	  for (int g=0;g<numGroups;g++) {
+	  		  SPGroupData& gd=spd.gdata[g];
+	  		  if (gd.r==NULL) continue;
+	  		  int64_t gYC=gd.accYC+gd.dupCount;
+	  		  if (gYC>UINT32_MAX) gYC=UINT32_MAX;
+	  		  if (gYC>1) gd.r->add_int_tag("YC", gYC);
+	  		  if (gd.accYX>1) gd.r->add_int_tag("YX", gd.accYX);
+	  		  if (gd.maxYD>0) gd.r->add_int_tag("YD", gd.maxYD);
+	  		  else gd.r->remove_tag("YD");
+	  		  encNs+=writeTimed(out.gwriters[g], gd.r);
+	  	  }
+	  }
+  }
+  if (runStats) {
+	  runStats->groupSize(spdlst.Count());
+	  runStats->addStage(tsFlush, tstat_now()-t0-encNs);
   }
   spdlst.Clear();
 }
 
-bool passes_options(GSamRecord* brec){
-    if(!options.keep_supplementary && brec->get_b()->core.flag & 0x100) return false;
-    if(!options.keep_unmapped && brec->isUnmapped()) return false;
-    if(brec->mapq()<options.min_qual) return false;
-    int nh = brec->tag_int("NH");
+//also applied to the raw records of the base file (--update)
+bool passes_options(const bam1_t* b){
+    if(!options.keep_supplementary && b->core.flag & 0x100) return false;
+    if(!options.keep_unmapped && (b->core.flag & BAM_FUNMAP)) return false;
+    if(b->core.qual<options.min_qual) return false;
+    uint8_t* nh_tag=bam_aux_get(b, "NH");
+    int nh = nh_tag ? bam_aux2i(nh_tag) : 0;
     if(nh>options.max_nh)  return false;
 
     return true;
 }
 
+bool passes_options(GSamRecord* brec){
+    return passes_options(brec->get_b());
+}
+
 // >------------------ main() start -----
 
 // merging indices can be done as follows:
@@ -528,25 +550,298 @@ bool passes_options(GSamRecord* brec){
 // process indices one by one
 //  1.
 
-int main(int argc, char *argv[])  {
-	inRecords.setup(VERSION, argc, argv);
-	processOptions(argc, argv);
-	int numSamples=inRecords.start();
-	outfile=new GSamWriter(outfname, inRecords.header(), GSamFile_BAM);
-	rspacing.init(numSamples);
+//sample group manifest: one "<input file> <group name>" pair per line;
+// if no input files were given, the manifest files are the inputs
+void loadGroups(const char* fname) {
+	FILE* f=fopen(fname, "r");
+	if (f==NULL) GError("Error: could not open group manifest file %s!\n", fname);
+	bool addInputs=(inRecords.count()==0);
+	char* line=NULL;
+	int lcap=5000;
+	GMALLOC(line, lcap);
+	while (fgetline(line, lcap, f)) {
+		GStr s(line);
+		s.trim();
+		if (s.length()<2 || s[0]=='#') continue;
+		s.startTokenize(" \t");
+		GStr ifn, gname;
+		s.nextToken(ifn);
+		s.nextToken(gname);
+		if (gname.is_empty())
+			GError("Error: invalid group manifest line (expected <file> <group>): %s\n", line);
+		if (groupTags && gname.index(',')>=0)
+			GError("Error: group names cannot contain commas (%s)!\n", gname.chars());
+		int g=-1;
+		for (int i=0;i<groupNames.Count();i++)
+			if (groupNames[i]==gname) { g=i; break; }
+		if (g<0) g=groupNames.Add(gname);
+		std::string fullfn=get_full_path(ifn.chars());
+		if (!fileGroups.insert(std::make_pair(fullfn, g)).second)
+			GError("Error: file %s is listed more than once in %s!\n", ifn.chars(), fname);
+		if (addInputs) inRecords.addFile(fullfn.c_str());
+	}
+	GFREE(line);
+	fclose(f);
+	numGroups=groupNames.Count();
+	if (numGroups==0) GError("Error: no groups found in %s!\n", fname);
+}
+
+//group of each input of the current merge pass; with --group-tags, the
+// groups of inputs carrying per-group tags are also added (by name)
+void setupInputGroups(TInputFiles& inputs) {
+	inputGroup.Clear();
+	inputGroupMap.clear();
+	inputGroupMap.resize(numInputs);
+	inputGroupTags=false;
+	for (int i=0;i<numInputs;i++) {
+		int g=-1;
+		if (!fileGroups.empty()) {
+			auto it=fileGroups.find(get_full_path(inputs.freaders[i]->fname.chars()));
+			if (it!=fileGroups.end()) g=it->second;
+		}
+		inputGroup.Add(g);
+		std::vector<std::string> inames;
+		if (!load_group_names(inputs.freaders[i]->samreader->header(), inames)) continue;
+		inputGroupTags=true;
+		if (!groupTags) continue;
+		for (uint j=0;j<inames.size();j++) {
+			int og=-1;
+			for (int k=0;k<groupNames.Count();k++)
+				if (groupNames[k]==inames[j].c_str()) { og=k; break; }
+			if (og<0) og=groupNames.Add(GStr(inames[j].c_str()));
+			inputGroupMap[i].push_back(og);
+		}
+	}
+	numGroups=groupNames.Count();
+}
+
+//copy of hdr with its GROUPS line replaced by the current group names
+// (or just removed, when per-group tags are not written)
+static sam_hdr_t* hdrWithGroups(sam_hdr_t* hdr) {
+	std::string text;
+	const size_t tlen=strlen(TB_GROUPS_TAG);
+	scan_hdr_lines(hdr, [&](const char* p, const char* eol) {
+		if (eol-p>(long)(4+tlen) && memcmp(p, "@CO\t", 4)==0 && memcmp(p+4, TB_GROUPS_TAG, tlen)==0)
+			return true;
+		text.append(p, eol-p);
+		text+='\n';
+		return true;
+	});
+	if (groupTags && numGroups>0) {
+		text.append("@CO\t" TB_GROUPS_TAG);
+		for (int g=0;g<numGroups;g++) {
+			if (g>0) text+=',';
+			text.append(groupNames[g].chars());
+		}
+		text+='\n';
+	}
+	sam_hdr_t* h=sam_hdr_parse(text.length(), text.c_str());
+	if (h==NULL) GError("Error: failed to rebuild the output header!\n");
+	return h;
+}
+
+//if the sample registry sidecar is not in the same directory as outfn,
+// put a copy there (the header of outfn refers to it by file name only)
+void copySampleRegistry(const char* regfn, const char* outfn) {
+	const char* rb=strrchr(regfn, '/');
+	const char* ob=strrchr(outfn, '/');
+	std::string rdir(regfn, rb ? rb-regfn+1 : 0);
+	std::string odir(outfn, ob ? ob-outfn+1 : 0);
+	if (rdir==odir) return;
+	GStr dest(odir.c_str());
+	dest.append(rb ? rb+1 : regfn);
+	FILE* fi=fopen(regfn, "rb");
+	FILE* fo=fopen(dest.chars(), "wb");
+	if (fi==NULL || fo==NULL) GError("Error copying sample registry %s to %s\n", regfn, dest.chars());
+	char buf[65536];
+	size_t n=0;
+	while ((n=fread(buf, 1, sizeof(buf), fi))>0)
+		if (fwrite(buf, 1, n, fo)!=n) GError("Error writing file %s\n", dest.chars());
+	fclose(fi);
+	fclose(fo);
+}
+
+//state of a single pass merge at a chromosome boundary (--checkpoint): the
+// output files are flushed up to a BGZF block boundary and each input is at
+// its first record not merged yet; nothing else needs to be saved, as no
+// merge data is kept across chromosomes (rspacing is reset)
+struct TBCheckpoint {
+	uint64_t inCount;
+	std::vector<std::string> outNames; //all output files, including group files
+	std::vector<int64_t> outOffsets;
+	std::vector<uint64_t> outCounts; //records written to each -o output
+	std::vector<std::string> inNames;
+	std::vector<int64_t> inOffsets;
+	TBCheckpoint():inCount(0) { }
+	void save(const char* fn) { //replaces fn only when complete
+		GStr tmpfn(fn);
+		tmpfn.append(".tmp");
+		FILE* f=fopen(tmpfn.chars(), "w");
+		if (f==NULL) GError("Error creating checkpoint file %s\n", tmpfn.chars());
+		fprintf(f, "TBCKPT1\nin_count %llu\n", (unsigned long long)inCount);
+		for (uint i=0;i<outNames.size();i++)
+			fprintf(f, "output %lld %s\n", (long long)outOffsets[i], outNames[i].c_str());
+		for (uint i=0;i<outCounts.size();i++)
+			fprintf(f, "count %llu\n", (unsigned long long)outCounts[i]);
+		for (uint i=0;i<inNames.size();i++)
+			fprintf(f, "input %lld %s\n", (long long)inOffsets[i], inNames[i].c_str());
+		if (fflush(f)!=0 || fsync(fileno(f))!=0 || fclose(f)!=0)
+			GError("Error writing checkpoint file %s\n", tmpfn.chars());
+		if (rename(tmpfn.chars(), fn)!=0)
+			GError("Error renaming checkpoint file %s\n", tmpfn.chars());
+	}
+	bool load(const char* fn) {
+		FILE* f=fopen(fn, "r");
+		if (f==NULL) return false;
+		char* line=NULL;
+		int lcap=5000;
+		GMALLOC(line, lcap);
+		bool valid=(fgetline(line, lcap, f)!=NULL && strcmp(line, "TBCKPT1")==0);
+		while (valid && fgetline(line, lcap, f)) {
+			unsigned long long v=0;
+			long long offs=0;
+			int n=0;
+			if (sscanf(line, "in_count %llu", &v)==1) inCount=v;
+			else if (sscanf(line, "count %llu", &v)==1) outCounts.push_back(v);
+			else if (sscanf(line, "output %lld %n", &offs, &n)==1 && n>0) {
+				outOffsets.push_back(offs);
+				outNames.push_back(line+n);
+			}
+			else if (sscanf(line, "input %lld %n", &offs, &n)==1 && n>0) {
+				inOffsets.push_back(offs);
+				inNames.push_back(line+n);
+			}
+			else valid=false;
+		}
+		GFREE(line);
+		fclose(f);
+		if (!valid) GError("Error: invalid checkpoint file %s\n", fn);
+		return true;
+	}
+};
+
+//save the merge state before cur, the first record of a new chromosome, is
+// merged; returns false if the input positions cannot be restored
+bool saveCheckpoint(const char* fn, TInputFiles& inputs, GPVec<TBrushOutput>& outs,
+		TInputRecord* cur, uint64_t inCount) {
+	TBCheckpoint ck;
+	if (!inputs.headOffsets(cur, ck.inOffsets)) return false;
+	ck.inCount=inCount;
+	for (int i=0;i<inputs.count();i++) ck.inNames.push_back(inputs.freaders[i]->fname.chars());
+	for (int k=0;k<outs.Count();k++) {
+		ck.outNames.push_back(outs[k]->fname.chars());
+		ck.outOffsets.push_back(outs[k]->writer->flushBlocks());
+		for (int g=0;g<outs[k]->gwriters.Count();g++) {
+			ck.outNames.push_back(outs[k]->groupFileName(g).chars());
+			ck.outOffsets.push_back(outs[k]->gwriters[g]->flushBlocks());
+		}
+		ck.outCounts.push_back(outs[k]->outCounter);
+	}
+	ck.save(fn);
+	return true;
+}
+
+//merge all the files in inputs into each of the outputs in outs, in a single
+// pass; countInput should be false when the inputs are intermediate files,
+// already counted when they were created; with checkpoints, the merge state
+// is saved at chromosome boundaries (see --checkpoint and --resume); hot, if
+// given, collects the hot-locus data of this pass (--hot-loci)
+void mergeInputs(TInputFiles& inputs, GPVec<TBrushOutput>& outs, GSamFileType ftype, bool countInput,
+		bool checkpoints=false, THotLoci* hot=NULL) {
+	{
+		TStageTimer tm(tsHeaderLoad);
+		numInputs=inputs.start();
+	}
+	if (runStats && countInput) //per-input throughput of the original inputs only
+		for (int i=0;i<numInputs;i++)
+			inputs.freaders[i]->statIdx=runStats->addInput(inputs.freaders[i]->fname.chars());
+	setupInputGroups(inputs);
+	GStr ckfname(outs[0]->fname);
+	ckfname.append(".tbckpt");
+	TBCheckpoint ck;
+	bool resuming=(checkpoints && resumeRun && ck.load(ckfname.chars()));
+	if (resuming) {
+		bool same=((int)ck.inNames.size()==numInputs && (int)ck.outCounts.size()==outs.Count());
+		for (int i=0;same && i<numInputs;i++)
+			same=(ck.inNames[i]==inputs.freaders[i]->fname.chars());
+		if (!same) GError("Error: checkpoint file %s was saved for a different set of files!\n", ckfname.chars());
+		GMessage("Resuming from checkpoint %s\n", ckfname.chars());
+	}
+	uint wi=0; //output file index in the checkpoint
+	auto openWriter=[&](const char* fn, sam_hdr_t* h) {
+		TMemScope ms(tmOutput);
+		if (!resuming) return new GSamWriter(fn, h, ftype);
+		if (wi>=ck.outNames.size() || ck.outNames[wi]!=fn)
+			GError("Error: output file %s not found in checkpoint file %s!\n", fn, ckfname.chars());
+		return new GSamWriter(fn, h, ck.outOffsets[wi++], ftype); //continue the file
+	};
+	sam_hdr_t* ohdr=(groupTags || inputGroupTags) ? hdrWithGroups(inputs.header()) : NULL;
+	for (int k=0;k<outs.Count();k++) {
+		outs[k]->writer=openWriter(outs[k]->fname.chars(), ohdr ? ohdr : inputs.header());
+		if (ftype==GSamFile_BAM) outs[k]->writer->setThreads(inputs.numThreads);
+		{
+			TMemScope ms(tmSpacing);
+			outs[k]->rspacing.init(numInputs);
+		}
+		outs[k]->outCounter=0;
+		for (int g=0;!groupTags && g<numGroups;g++) { //header with only the group's samples
+			GStr gfn=outs[k]->groupFileName(g);
+			GVec<int> gfiles;
+			for (int i=0;i<numInputs;i++)
+				if (inputGroup[i]==g) gfiles.Add(i);
+			GStr regfn;
+			if (useSampleRegistry) {
+				regfn=gfn;
+				regfn.append(TB_SAMPLE_REG_EXT);
+			}
+			sam_hdr_t* ghdr=inputs.subsetHeader(gfiles, regfn.is_empty() ? NULL : regfn.chars());
+			outs[k]->gwriters.Add(openWriter(gfn.chars(), ghdr));
+			sam_hdr_destroy(ghdr);
+		}
+	}
+	if (ohdr!=NULL) sam_hdr_destroy(ohdr);
+	if (resuming) {
+		inputs.restart(ck.inOffsets);
+		inCounter=ck.inCount;
+		for (int k=0;k<outs.Count();k++) outs[k]->outCounter=ck.outCounts[k];
+	}
+	time_t lastCkpt=time(NULL);
+	int lastOut=outs.Count()-1;
 	TInputRecord* irec=NULL;
 	GSamRecord* brec=NULL;
 
-	GList<SPData> spdata(true, true, true); //list of Same Position data, with all possibly merged records
 	bool newChr=false;
 	int prev_pos=-1;
+	uint64_t posRecs=0; //records at the current position (--stats)
 	int prev_tid=-1;
-	while ((irec=inRecords.next())!=NULL) {
-		 brec=irec->brec;
-         if(!passes_options(brec)) continue;
-		 inCounter++;
-		 int tid=brec->refId();
-		 int pos=brec->start; //1-based
+	uint64_t tflush=0;
+	//pass-through records must not keep invalid per-group tags
+	bool stripBaseTags=(inputs.baseInput()>=0 && inputGroupTags && !groupTags);
+	if (inputs.baseInput()>=0 && groupTags) { //their group indexes must not change
+		int bi=inputs.baseInput();
+		const char* bfn=inputs.freaders[bi]->fname.chars();
+		if (inputGroupMap[bi].empty() && inputGroup[bi]>=0)
+			GError("Error: %s has no per-group tags and cannot be assigned a group with --update!\n", bfn);
+		for (uint i=0;i<inputGroupMap[bi].size();i++)
+			if (inputGroupMap[bi][i]!=(int)i)
+				GError("Error: the groups of %s must come first, in the same order, in the group manifest!\n", bfn);
+	}
+	while (true) {
+		 //records of the base file (--update) that cannot be merged are written as they are
+		 bam1_t* rawb=inputs.nextRaw();
+		 if (rawb!=NULL) {
+			 TStageTimer tm(tsFilter);
+			 if(!passes_options(rawb)) continue;
+		 }
+		 else {
+			 if ((irec=inputs.next())==NULL) break;
+			 brec=irec->brec;
+			 TStageTimer tm(tsFilter);
+			 if(!passes_options(brec)) continue;
+		 }
+		 if (countInput) inCounter++;
+		 int tid=rawb ? rawb->core.tid : brec->refId();
+		 int pos=rawb ? rawb->core.pos+1 : brec->start; //1-based
 
 		 if (tid!=prev_tid) {
 			 if (prev_tid!=-1) newChr=true;
@@ -554,29 +849,261 @@ int main(int argc, char *argv[])  {
 			 prev_pos=-1;
 		 }
 		 if (pos!=prev_pos) { //new position
-			 flushPData(spdata); //also adds read data to rspacing
+			 if (hot) {
+				 hot->cur.groups=outs[0]->spdata.Count();
+				 tflush=tstat_now();
+			 }
+			 for (int k=0;k<=lastOut;k++)
+				 flushPData(*outs[k]); //also adds read data to rspacing
+			 if (hot) hot->next(tid, pos, tstat_now()-tflush, spdCompares);
 			 prev_pos=pos;
+			 if (runStats) {
+				 if (posRecs>0 && countInput) runStats->addBundle(posRecs);
+				 posRecs=0;
+				 if (countInput) runStats->inRecords=inCounter;
+				 runStats->outRecords=outs[0]->outCounter;
+				 runStats->tick();
+			 }
+			 if (progress && countInput && progress->due())
+				 progress->report(inputs.bytesDone(), inCounter,
+						 tid>=0 ? sam_hdr_tid2name(inputs.header(), tid) : NULL, pos);
 		 }
+		 posRecs++;
+		 if (hot) hot->cur.records++;
 		 if (newChr) {
-			 rspacing.reset();
+			 for (int k=0;k<=lastOut;k++) outs[k]->rspacing.reset();
 			 newChr=false;
+			 if (checkpoints && rawb==NULL && time(NULL)-lastCkpt>=checkpointSecs) {
+				 //the current record is counted again when resuming
+				 if (saveCheckpoint(ckfname.chars(), inputs, outs, irec, inCounter-(countInput ? 1 : 0)))
+					 lastCkpt=time(NULL);
+				 else {
+					 GMessage("Warning: the positions of these input files cannot be saved, checkpoints disabled.\n");
+					 checkpoints=false;
+				 }
+			 }
 		 }
-		 addPData(*irec, spdata);
+		 if (rawb) {
+			 if (stripBaseTags) {
+				 uint8_t* t=bam_aux_get(rawb, TB_GROUP_COV_TAG);
+				 if (t) bam_aux_del(rawb, t);
+				 if ((t=bam_aux_get(rawb, TB_GROUP_SMP_TAG))!=NULL) bam_aux_del(rawb, t);
+			 }
+			 writeTimed(outs[0]->writer, rawb);
+			 outs[0]->outCounter++;
+			 continue;
+		 }
+		 //only the last output takes over the input record, the others copy it
+		 TStageTimer tm(tsGroup);
+		 uint64_t tadd=hot ? tstat_now() : 0;
+		 for (int k=0;k<=lastOut;k++)
+			 addPData(*irec, *outs[k], k<lastOut);
+		 if (hot) hot->cur.addNs+=tstat_now()-tadd;
+	}
+	if (runStats && posRecs>0 && countInput) runStats->addBundle(posRecs);
+	if (hot) {
+		hot->cur.groups=outs[0]->spdata.Count();
+		tflush=tstat_now();
+		for (int k=0;k<=lastOut;k++) flushPData(*outs[k]);
+		hot->next(-1, 0, tstat_now()-tflush, spdCompares);
+		hot->write(hotLociFname.chars(), inputs.header());
 	}
-    flushPData(spdata);
-	inRecords.stop();
+	for (int k=0;k<=lastOut;k++) {
+		flushPData(*outs[k]);
+		delete outs[k]->writer;
+		outs[k]->writer=NULL;
+		outs[k]->gwriters.Clear();
+	}
+	if (progress && countInput) progress->doneBase+=inputs.bytesTotal();
+	inputs.stop();
+	if (checkpoints) unlink(ckfname.chars()); //completed
+	if (!inputs.sampleRegistry.is_empty())
+		for (int k=1;k<=lastOut;k++)
+			copySampleRegistry(inputs.sampleRegistry.chars(), outs[k]->fname.chars());
+}
+
+void removeTmpFile(const char* fn) {
+	unlink(fn);
+	if (useSampleRegistry) {
+		GStr regfn(fn);
+		regfn.append(TB_SAMPLE_REG_EXT);
+		unlink(regfn.chars());
+	}
+}
+
+//when there are more inputs than we can keep open at once, merge them in
+// groups into temporary (uncompressed) BAM files, then merge those files;
+// the intermediate files carry YC/YX/YD and the @CO SAMPLE lines of their
+// group, so the final result is the same as that of a single pass merge.
+// The first level produces intermediate files for all outputs in the same
+// pass; each output then has its own chain of intermediate files.
+void mergeTree(int maxOpen) {
+	int nout=brushOutputs.Count();
+	std::vector< std::vector<std::string> > level(nout); //input files for each output
+	for (int i=0;i<inRecords.count();i++)
+		for (int k=0;k<nout;k++) level[k].push_back(inRecords.freaders[i]->fname.chars());
+	int lvl=0;
+	while ((int)level[0].size()>maxOpen) {
+		int lcount=level[0].size();
+		int ngroups=(lcount+maxOpen-1)/maxOpen;
+		std::vector< std::vector<std::string> > nextLevel(nout);
+		int gstart=0;
+		for (int g=0;g<ngroups;g++) {
+			int gend=(int)(((int64_t)lcount*(g+1))/ngroups); //balanced group sizes
+			if (verbose)
+				GMessage("Merging inputs %d-%d of level %d\n", gstart+1, gend, lvl);
+			for (int k=0;k<nout;k++) {
+				if (lvl>0 || k==0) {
+					TInputFiles grp;
+					grp.copySetup(inRecords);
+					GPVec<TBrushOutput> gouts(true);
+					int kmax=(lvl==0) ? nout : k+1; //first level: all outputs at once
+					for (int j=k;j<kmax;j++) {
+						GStr tmpfn(outfname);
+						tmpfn.appendfmt(".tbtmp.%d.%d.%d.bam", lvl, g, j);
+						gouts.Add(new TBrushOutput(brushOutputs[j]->strategy, tmpfn.chars()));
+						nextLevel[j].push_back(tmpfn.chars());
+					}
+					if (useSampleRegistry) {
+						grp.sampleRegistry=gouts[0]->fname;
+						grp.sampleRegistry.append(TB_SAMPLE_REG_EXT);
+					}
+					for (int i=gstart;i<gend;i++) {
+						if (lvl==0 && i==inRecords.baseInput()) //--update: still copied as it is
+							grp.addBase(level[k][i].c_str());
+						else grp.addFile(level[k][i].c_str());
+					}
+					mergeInputs(grp, gouts, GSamFile_UBAM, lvl==0);
+				}
+			}
+			gstart=gend;
+		}
+		if (lvl>0) //the previous level's intermediate files are no longer needed
+			for (int k=0;k<nout;k++)
+				for (uint i=0;i<level[k].size();i++) removeTmpFile(level[k][i].c_str());
+		level=nextLevel;
+		lvl++;
+	}
+	for (int k=0;k<nout;k++) {
+		TInputFiles top;
+		top.copySetup(inRecords);
+		if (useSampleRegistry) {
+			top.sampleRegistry=brushOutputs[k]->fname;
+			top.sampleRegistry.append(TB_SAMPLE_REG_EXT);
+		}
+		for (uint i=0;i<level[k].size();i++) top.addFile(level[k][i].c_str());
+		GPVec<TBrushOutput> touts(false);
+		touts.Add(brushOutputs[k]);
+		//the hot loci are only taken from the last level (first output), where
+		// the records of each position come together
+		mergeInputs(top, touts, GSamFile_BAM, lvl==0, false, (k==0) ? hotLoci : NULL);
+	}
+	if (lvl>0)
+		for (int k=0;k<nout;k++)
+			for (uint i=0;i<level[k].size();i++) removeTmpFile(level[k][i].c_str());
+}
 
-    delete outfile;
+int main(int argc, char *argv[])  {
+	inRecords.setup(VERSION, argc, argv);
+	processOptions(argc, argv);
+	inRecords.loadFileList();
+	if (concatShards) {
+		std::vector<std::string> fnames;
+		std::string ofn=(fileExists(outfname.chars())>1) ? get_full_path(outfname.chars()) : "";
+		for (int i=0;i<inRecords.count();i++) {
+			if (ofn==inRecords.freaders[i]->fname.chars())
+				GError("Error: shard file %s cannot be the output!\n", ofn.c_str());
+			fnames.push_back(inRecords.freaders[i]->fname.chars());
+		}
+		TShardConcat shards;
+		shards.load(fnames);
+		shards.write(outfname.chars(), indexOutput);
+		if (verbose) GMessage("%d shards written to %s\n", (int)fnames.size(), outfname.chars());
+		return 0;
+	}
+	if (!groupsfname.is_empty()) loadGroups(groupsfname.chars());
+	if (!basefname.is_empty()) inRecords.addBase(basefname.chars());
+	if (progressSecs>0) progress=new TProgress(progressSecs, inRecords.bytesTotal());
+	int maxOpen=maxOpenFiles;
+	if (maxOpen<=0) { //leave some room for the output and other files
+		struct rlimit rl;
+		maxOpen=1000;
+		if (getrlimit(RLIMIT_NOFILE, &rl)==0 && rl.rlim_cur!=RLIM_INFINITY &&
+				(int64_t)rl.rlim_cur-32-brushOutputs.Count()<maxOpen)
+			maxOpen=(int)rl.rlim_cur-32-brushOutputs.Count();
+	}
+	if (maxOpen<2) maxOpen=2;
+	inRecords.maxOpen=maxOpen;
+	if (inRecords.count()>maxOpen) {
+		if (numGroups>0 && !groupTags)
+			GError("Error: group outputs cannot be produced for more than %d input files "
+					"(see --max-open)!\n", maxOpen);
+		if (checkpointSecs>=0)
+			GMessage("Warning: checkpoints are not saved when merging more than %d input files.\n", maxOpen);
+		mergeTree(maxOpen);
+	}
+	else mergeInputs(inRecords, brushOutputs, GSamFile_BAM, true, checkpointSecs>=0, hotLoci);
 
     //if (verbose) {
-    double p=100.00 - (double)(outCounter*100.00)/(double)inCounter;
-    GMessage("%ld input records written as %ld (%.2f%% reduction)\n", inCounter, outCounter, p);
+    for (int k=0;k<brushOutputs.Count();k++) {
+        uint64_t outCounter=brushOutputs[k]->outCounter;
+        double p=100.00 - (double)(outCounter*100.00)/(double)inCounter;
+        if (brushOutputs.Count()==1)
+            GMessage("%ld input records written as %ld (%.2f%% reduction)\n", inCounter, outCounter, p);
+        else
+            GMessage("%ld input records written as %ld (%.2f%% reduction) to %s\n", inCounter, outCounter, p,
+                     brushOutputs[k]->fname.chars());
+    }
     //}
+    delete progress;
+    if (runStats) {
+        runStats->inRecords=inCounter;
+        runStats->outRecords=brushOutputs[0]->outCounter;
+        runStats->write(true);
+        delete runStats;
+    }
+    delete hotLoci;
+    tmem_report(stderr);
 }
 // <------------------ main() end -----
 
+const char* ARGS_FORMAT="help;debug;verbose;version;full;clip;exon;keep-supp;keep-unmap;sample-registry;group-tags;sort;max-open=;groups=;sort-mem=;tmp-dir=;update=;checkpoint=;resume;shard=;concat;index;stats=;progress=;hot-loci=;hot-top=;SMLPEDVho:N:Q:F:t:";
+
+//GArgs only keeps the first value of an option given several times; this
+// collects all the values of short option o from a command line that GArgs
+// accepted, reading it with the same format: short options can be grouped
+// (-Vo out.bam) and their value attached (-oout.bam) or in the next argument,
+// and the values of the other options are skipped
+void getOptValues(int argc, char* argv[], const char* format, char o, GVec<GStr>& vals) {
+    const char* sopts=strrchr(format, ';');
+    sopts=(sopts==NULL) ? format : sopts+1;
+    for (int i=1;i<argc;i++) {
+        const char* a=argv[i];
+        if (a[0]!='-' || a[1]==0) continue;
+        if (a[1]=='-') { //long option, its value may be in the next argument
+            if (strchr(a, '=')!=NULL) continue;
+            GStr lopt(a+2);
+            lopt.append('=');
+            const char* f=strstr(format, lopt.chars());
+            if (f!=NULL && (f==format || f[-1]==';') && i+1<argc) i++;
+            continue;
+        }
+        for (const char* c=a+1;*c;c++) {
+            const char* f=strchr(sopts, *c);
+            if (f==NULL || f[1]!=':') continue; //flag
+            const char* v=c+1;
+            if (*v==0) {
+                if (i+1>=argc) break;
+                v=argv[++i];
+            }
+            if (*c==o) vals.Add(GStr(v));
+            break; //the rest of the argument was the value
+        }
+    }
+}
+
 void processOptions(int argc, char* argv[]) {
-    GArgs args(argc, argv, "help;debug;verbose;version;full;clip;exon;keep-supp;keep-unmap;SMLPEDVho:N:Q:F:");
+    GArgs args(argc, argv, ARGS_FORMAT);
     args.printError(USAGE, true);
 
     if (args.getOpt('h') || args.getOpt("help")) {
@@ -589,13 +1116,16 @@ void processOptions(int argc, char* argv[]) {
         exit(0);
     }
 
-    if (args.startNonOpt()==0) {
+    groupsfname=args.getOpt("groups");
+    groupTags=(args.getOpt("group-tags")!=NULL);
+    if (args.startNonOpt()==0 && groupsfname.is_empty()) {
         GMessage(USAGE);
         GMessage("\nError: no input provided!\n");
         exit(1);
     }
-    outfname=args.getOpt('o');
-    if (outfname.is_empty()) {
+    GVec<GStr> outspecs; //-o can be given multiple times
+    getOptValues(argc, argv, ARGS_FORMAT, 'o', outspecs);
+    if (outspecs.Count()==0) {
         GMessage(USAGE);
         GMessage("\nError: output filename must be provided (-o)!\n");
         exit(1);
@@ -613,6 +1143,16 @@ void processOptions(int argc, char* argv[]) {
     if (!flag_str.is_empty()) {
         options.flags=flag_str.asInt();
     }
+    GStr threads_str=args.getOpt('t');
+    if (!threads_str.is_empty()) {
+        inRecords.numThreads=threads_str.asInt();
+        if (inRecords.numThreads<1) GError("Error: invalid number of threads (-t)!\n");
+    }
+    GStr max_open_str=args.getOpt("max-open");
+    if (!max_open_str.is_empty()) {
+        maxOpenFiles=max_open_str.asInt();
+        if (maxOpenFiles<2) GError("Error: --max-open value must be at least 2!\n");
+    }
     options.keep_supplementary = (args.getOpt("keep-supp")!=NULL || args.getOpt("S")!=NULL);
     options.keep_unmapped = (args.getOpt("keep-unmap")!=NULL || args.getOpt("M")!=NULL);
 
@@ -626,6 +1166,89 @@ void processOptions(int argc, char* argv[]) {
         else if (stratP) mrgStrategy=tMrgStratClip;
         else mrgStrategy=tMrgStratExon;
     }
+    //outputs can be prefixed by their own merge strategy (cigar:, full:, clip: or exon:)
+    for (int i=0;i<outspecs.Count();i++) {
+        GStr& ospec=outspecs[i];
+        TMrgStrategy ostrat=mrgStrategy;
+        int p=ospec.index(':');
+        if (p>0) {
+            GStr sname=ospec.substr(0, p);
+            bool found=true;
+            if (sname=="cigar") ostrat=tMrgStratCIGAR;
+            else if (sname=="full") ostrat=tMrgStratFull;
+            else if (sname=="clip") ostrat=tMrgStratClip;
+            else if (sname=="exon") ostrat=tMrgStratExon;
+            else found=false;
+            if (found) ospec.cut(0, p+1);
+        }
+        for (int j=0;j<brushOutputs.Count();j++)
+            if (brushOutputs[j]->fname==ospec)
+                GError("Error: output file %s given more than once!\n", ospec.chars());
+        brushOutputs.Add(new TBrushOutput(ostrat, ospec.chars()));
+    }
+    outfname=brushOutputs[0]->fname;
+    basefname=args.getOpt("update");
+    if (!basefname.is_empty()) {
+        if (brushOutputs.Count()>1)
+            GError("Error: --update can only produce one output file!\n");
+        if (!groupsfname.is_empty() && !groupTags)
+            GError("Error: --update cannot be used with group output files (see --group-tags)!\n");
+        basefname=get_full_path(basefname.chars()).c_str();
+        for (int j=0;j<brushOutputs.Count();j++)
+            if (fileExists(brushOutputs[j]->fname.chars())>1 &&
+                    get_full_path(brushOutputs[j]->fname.chars())==basefname.chars())
+                GError("Error: the --update file cannot be overwritten!\n");
+    }
+    GStr ckpt_str=args.getOpt("checkpoint");
+    if (!ckpt_str.is_empty()) {
+        checkpointSecs=ckpt_str.asInt();
+        if (checkpointSecs<0) GError("Error: invalid --checkpoint interval!\n");
+    }
+    resumeRun=(args.getOpt("resume")!=NULL);
+    concatShards=(args.getOpt("concat")!=NULL);
+    indexOutput=(args.getOpt("index")!=NULL);
+    if (indexOutput && !concatShards) GError("Error: --index can only be used with --concat!\n");
+    GStr stats_str=args.getOpt("stats");
+    if (!stats_str.is_empty()) runStats=new TRunStats(stats_str.chars(), "tiebrush");
+    hotLociFname=args.getOpt("hot-loci");
+    GStr hot_top_str=args.getOpt("hot-top");
+    if (!hot_top_str.is_empty()) {
+        hotLociTop=hot_top_str.asInt();
+        if (hotLociTop<1) GError("Error: invalid --hot-top value!\n");
+    }
+    if (!hotLociFname.is_empty()) hotLoci=new THotLoci(hotLociTop);
+    GStr progress_str=args.getOpt("progress");
+    if (!progress_str.is_empty()) {
+        progressSecs=progress_str.asInt();
+        if (progressSecs<1) GError("Error: invalid --progress interval!\n");
+    }
+    GStr shard_str=args.getOpt("shard");
+    if (!shard_str.is_empty()) {
+        int si=0, sn=0;
+        if (sscanf(shard_str.chars(), "%d/%d", &si, &sn)!=2 || sn<1 || si<1 || si>sn)
+            GError("Error: invalid --shard value (expected i/N, with 1<=i<=N)!\n");
+        if (!basefname.is_empty()) GError("Error: --shard cannot be used with --update!\n");
+        inRecords.shardIdx=si-1;
+        inRecords.numShards=sn;
+    }
+    if (resumeRun && checkpointSecs<0) checkpointSecs=600;
+    inRecords.sortInputs=(args.getOpt("sort")!=NULL);
+    GStr sort_mem_str=args.getOpt("sort-mem");
+    if (!sort_mem_str.is_empty()) {
+        int mb=sort_mem_str.asInt();
+        if (mb<16) GError("Error: --sort-mem value must be at least 16 (MB)!\n");
+        inRecords.sortMem=((size_t)mb)<<20;
+    }
+    inRecords.sortTmpDir=args.getOpt("tmp-dir");
+    if (inRecords.sortTmpDir.is_empty()) { //default: the directory of the output file
+        int p=outfname.rindex('/');
+        inRecords.sortTmpDir=(p>0) ? outfname.substr(0, p) : GStr((p==0) ? "/" : ".");
+    }
+    useSampleRegistry=(args.getOpt("sample-registry")!=NULL);
+    if (useSampleRegistry) {
+        inRecords.sampleRegistry=outfname;
+        inRecords.sampleRegistry.append(TB_SAMPLE_REG_EXT);
+    }
 
     verbose=(args.getOpt("verbose")!=NULL || args.getOpt('V')!=NULL);
     if (verbose) {
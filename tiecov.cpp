@@ -7,6 +7,16 @@
 #include <string>
 #include <utility>
 #include <set>
+#include <queue>
+#include <list>
+#include <unordered_set>
+#include <unordered_map>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
 
 #include "commons.h"
 #include "GArgs.h"
@@ -14,6 +24,10 @@
 #include "GVec.hh"
 #include "GSam.h"
 #include "bigWig.h"
+#include "tcovpyr.h"
+#include "tstats.h"
+#include "tcov.h"
+#include "tmemacct.h"
 
 #define VERSION "0.0.6"
 
@@ -25,13 +39,13 @@ const char* USAGE="TieCov v" VERSION "\n"
 " 3. a heatmap BED that uses color intensity to represent the number of samples that contain each position\n"
 "==================\n"
 "\n"
-" usage: tiecov [-s out.sample] [-c out.coverage] [-j out.junctions] [-W] input\n"
+" usage: tiecov [-s out.sample] [-c out.coverage] [-j out.junctions] [-p out.tcp] [-W] [--tophat] [--stranded] [--groups] [-r regions] input\n"
 "\n"
 " Input arguments (required): \n"
 "  input\t\talignment file in SAM/BAM/CRAM format\n"
 "       "
 "\n"
-" Optional arguments (at least one of -s/-c/-j must be specified):\n"
+" Optional arguments (at least one of -s/-c/-j/-p must be specified):\n"
 "  -h,--help\tShow this help message and exit\n"
 "  --version\tShow program version and exit\n"
 "  -s\t\tBedGraph file with an estimate of the number of samples\n"
@@ -41,9 +55,41 @@ const char* USAGE="TieCov v" VERSION "\n"
 "  -j\t\tBED file with coverage of all splice-junctions\n"
 "    \t\tin the input file.\n"
 "  -W\t\tsave coverage in BigWig format. Default output\n"
-"    \t\tis in Bed format\n";
+"    \t\tis in Bed format\n"
+"  --tophat\twrite junctions (-j) as TopHat-style two-block BED\n"
+"          \twhere each block spans the maximum read overhang\n"
+"          \ton that side of the junction\n"
+"  --stranded\twrite separate coverage (-c) and sample count (-s)\n"
+"            \ttracks for alignments on the +, - and unknown splice\n"
+"            \tstrand (.plus, .minus and .unstranded files)\n"
+"  --groups\twrite separate coverage (-c) and sample count (-s)\n"
+"          \ttracks for each sample group of a TieBrush output\n"
+"          \tcreated with --group-tags (.<group> files)\n"
+"  -r\t\tonly report coverage for the given regions, either\n"
+"    \t\ta BED file or a comma-delimited list of chr:start-end\n"
+"    \t\tstrings (requires an indexed input file); junctions\n"
+"    \t\tare reported for all reads overlapping the regions\n"
+"  -p\t\twrite a binary multi-resolution coverage summary\n"
+"    \t\t(base-level runs plus 1kb/10kb/100kb bins with\n"
+"    \t\tcoverage sum/min/max and max sample count)\n"
+"  --progress\treport the progress (input bytes read, rate, estimated\n"
+"            \ttime left) every given number of seconds\n"
+"  --stats\twrite a JSON report of the time spent decoding,\n"
+"         \tcomputing and writing coverage, and of the bundle\n"
+"         \tsizes to this file (updated every minute)\n"
+"\n"
+" usage: tiecov --query=<summary_file> chr:start-end [chr:start-end ...]\n"
+"  report coverage statistics for the given windows using only a\n"
+"  coverage summary file previously created with -p\n"
+"\n"
+" usage: tiecov --serve=<socket> [--cache=N] [--bgzf-cache=MB] input [input ...]\n"
+"  keep the indexed input files open and answer queries sent as lines over\n"
+"  the Unix domain <socket>: COV|SAMPLES|JUNC chr:start-end [file#], FILES,\n"
+"  QUIT or SHUTDOWN; each response ends with an END line. Up to N region\n"
+"  summaries (default 10000) and MB of decompressed BGZF blocks per file\n"
+"  (default 32) are cached\n";
 
-GStr covfname, jfname, infname, sfname;
+GStr covfname, jfname, infname, sfname, regspec, pyrfname, qpyrfname;
 FILE* coutf=NULL;
 FILE* joutf=NULL;
 FILE* soutf=NULL;
@@ -53,70 +99,37 @@ bigWigFile_t *coutf_bw = NULL;
 bigWigFile_t *joutf_bw = NULL;
 bigWigFile_t *soutf_bw = NULL;
 
-std::vector<std::string> sample_info; // holds data about samples from the header
+TCovPyramidWriter* pyrout=NULL; //multi-resolution coverage summary (-p)
 
-bool verbose=false;
-bool bigwig=false;
-int juncCount=0;
+bool stranded=false; //--stranded: separate coverage/sample tracks for each splice strand
+const char* strandSuffix[3]={".plus", ".minus", ".unstranded"};
+FILE* scoutf[3]={NULL, NULL, NULL}; //stranded coverage tracks (+, -, .)
+FILE* ssoutf[3]={NULL, NULL, NULL}; //stranded sample count tracks
 
-struct CJunc {
-	int start, end;
-	char strand;
-	uint64_t dupcount;
-	CJunc(int vs=0, int ve=0, char vstrand='+', uint64_t dcount=1):
-	  start(vs), end(ve), strand(vstrand), dupcount(dcount) { }
+bool groupTracks=false; //--groups: separate coverage/sample tracks for each sample group
+std::vector<std::string> groupNames; //from the GROUPS header line
+std::vector<FILE*> gcoutf; //per-group coverage tracks
+std::vector<FILE*> gsoutf; //per-group sample count tracks
 
-	bool operator==(const CJunc& a) {
-		return (strand==a.strand && start==a.start && end==a.end);
-	}
-
-    bool operator<(const CJunc& a) { // sort by strand last
-        if (start==a.start){
-            if(end==a.end){
-                return strand<a.strand;
-            }
-            else{
-                return (end<a.end);
-            }
-        }
-        else{
-            return (start<a.start);
-        }
-    }
-
-	void add(CJunc& j) {
-       dupcount+=j.dupcount;
-	}
+std::vector<std::string> sample_info; // holds data about samples from the header
 
-	void write(FILE* f, const char* chr) {
-		juncCount++;
-		fprintf(f, "%s\t%d\t%d\tJUNC%08d\t%ld\t%c\n",
-				chr, start-1, end, juncCount, (long)dupcount, strand);
-	}
-};
+std::vector< std::vector<GSeg> > qregions; // merged query regions (-r) for each tid, 1-based
+std::vector<std::string> qregion_strs; // the same regions as region strings for the index query
+GVec<GStr> qregions_args; // window queries given with --query
+GStr srvsockname; // --serve: answer queries over this Unix domain socket
+GVec<GStr> srvfnames; // alignment files to serve
+int srvCacheEntries=10000; // number of region summaries kept by the query server
+int srvBgzfCacheMB=32; // decompressed BGZF block cache for each input file served
 
-GArray<CJunc> junctions(64, true);
-
-void addJunction(GSamRecord& r, int dupcount) {
-	char strand = r.spliceStrand();
-//	if (strand!='+' && strand!='-') return; // TODO: should we output .?
-	for (int i=1;i<r.exons.Count();i++) {
-		CJunc j(r.exons[i-1].end+1, r.exons[i].start-1, strand,
-				dupcount);
-		int ei;
-		int r=junctions.AddIfNew(j, &ei);
-		if (r==-1) {//existing junction, update
-			junctions[ei].add(j);
-		}
-	}
-}
+bool verbose=false;
+int progressSecs=0; //--progress: seconds between progress reports
+bool bigwig=false;
+bool tophat=false; //write junctions as two-block BED with anchor overhangs
+CJuncTable junctions;
 
-void flushJuncs(FILE* f, const char* chr) {
-    for (int i=0;i<junctions.Count();i++) {
-    	junctions[i].write(f,chr);
-    }
-    junctions.Clear();
-    junctions.setCapacity(128);
+// junctions cannot be reached by reads starting at or after their own start
+void flushJuncs(FILE* f, sam_hdr_t* hdr, int tid=-1, int pos=0) {
+    junctions.flush(f, hdr, tid, pos);
 }
 
 void processOptions(int argc, char* argv[]);
@@ -190,38 +203,6 @@ void move2bsam(std::vector<std::set<int>>& bvec_idx,std::vector<std::pair<float,
     }
 }
 
-//b_start MUST be passed 1-based
-void addCov(GSamRecord& r, int val, GVec<uint64_t>& bvec, int b_start) {
-    bam1_t* in_rec=r.get_b();
-    int pos=in_rec->core.pos; // 0-based
-    b_start--; //to make it 0-based
-    for (uint8_t c=0;c<in_rec->core.n_cigar;++c){
-        uint32_t *cigar_full=bam_get_cigar(in_rec);
-        int opcode=bam_cigar_op(cigar_full[c]);
-        int oplen=bam_cigar_oplen(cigar_full[c]);
-        switch(opcode){
-            case BAM_CINS: // no change in coverage and position
-                break;
-            case BAM_CDEL: // skip to the next position - no change in coverage
-                pos+=oplen;
-                break;
-            case BAM_CREF_SKIP: // skip to the next position - no change in coverage
-                pos+=oplen;
-                break;
-            case BAM_CSOFT_CLIP:
-                break;
-            case BAM_CMATCH: // base match - add coverage
-                for(int i=0;i<oplen;i++) {
-                    bvec[pos-b_start]+=val;
-                    pos++;
-                }
-                break;
-            default:
-                GError("ERROR: unknown opcode: %c from read: %s",bam_cigar_opchr(opcode),bam_get_qname(in_rec));
-        }
-    }
-}
-
 //b_start MUST be passed 1-based
 void flushCoverage(FILE* outf,sam_hdr_t* hdr, GVec<uint64_t>& bvec,  int tid, int b_start) {
   if (tid<0 || b_start<=0) return;
@@ -342,15 +323,484 @@ void load_sample_list(std::vector<int>& lst,std::string& sl_fname,std::vector<st
     sl_fp.close();
 }
 
+//split a chr[:start[-end]] region string: reg is left with just the
+// reference name, rend is 0 when not given (i.e. up to the reference end);
+// returns false if the start coordinate is not valid (below 1)
+bool parseRegion(GStr& reg, uint32_t& rstart, uint32_t& rend) {
+    rstart=1;
+    rend=0;
+    int p=reg.rindex(':');
+    if (p<=0) return true;
+    GStr coords=reg.substr(p+1);
+    coords.replace(",", "");
+    int d=coords.index('-');
+    if (d>=0) {
+        rstart=coords.substr(0, d).asInt();
+        if (d<coords.length()-1) rend=coords.substr(d+1).asInt();
+    }
+    else rstart=coords.asInt();
+    reg.cut(p);
+    return (rstart>=1);
+}
+
+//parse a BED file or a comma-delimited list of chr[:start[-end]] strings
+// into merged, sorted region lists for each reference sequence
+void addQRegion(sam_hdr_t* hdr, const char* chr, int rstart, int rend) {
+    int tid=sam_hdr_name2tid(hdr, chr);
+    if (tid<0) {
+        GMessage("Warning: region reference %s not found in the input header, ignored.\n", chr);
+        return;
+    }
+    int reflen=(int)sam_hdr_tid2len(hdr, tid);
+    if (rstart<1) rstart=1;
+    if (rend<=0 || rend>reflen) rend=reflen;
+    if (rend<rstart) return;
+    if ((int)qregions.size()<=tid) qregions.resize(tid+1);
+    qregions[tid].push_back(GSeg(rstart, rend));
+}
+
+void loadRegions(sam_hdr_t* hdr, GStr& rspec) {
+    if (fileExists(rspec.chars())>1) { //BED file (0-based start, end exclusive)
+        FILE* fr=fopen(rspec.chars(), "r");
+        if (fr==NULL) GError("Error: could not open region file %s!\n", rspec.chars());
+        char* line=NULL;
+        int lcap=1024;
+        GMALLOC(line, lcap);
+        while (fgetline(line,lcap,fr)) {
+            if (line[0]=='#' || startsWith(line, "track") || startsWith(line, "browser")) continue;
+            char* chr=strtok(line, " \t");
+            char* sstart=strtok(NULL, " \t");
+            char* send=strtok(NULL, " \t\r\n");
+            if (chr==NULL || sstart==NULL || send==NULL) continue;
+            addQRegion(hdr, chr, atoi(sstart)+1, atoi(send));
+        }
+        GFREE(line);
+        fclose(fr);
+    }
+    else { //region strings, 1-based
+        GStr regs(rspec);
+        GStr reg;
+        regs.startTokenize(",");
+        while (regs.nextToken(reg)) {
+            uint32_t rstart=1, rend=0;
+            GStr sreg(reg);
+            if (!parseRegion(reg, rstart, rend))
+                GError("Error: invalid region %s (coordinates are 1-based)\n", sreg.chars());
+            addQRegion(hdr, reg.chars(), rstart, rend);
+        }
+    }
+    //sort and merge overlapping/adjacent regions
+    for (uint tid=0;tid<qregions.size();tid++) {
+        std::vector<GSeg>& rl=qregions[tid];
+        if (rl.empty()) continue;
+        std::sort(rl.begin(), rl.end());
+        uint m=0;
+        for (uint i=1;i<rl.size();i++) {
+            if (rl[i].start<=rl[m].end+1) {
+                if (rl[i].end>rl[m].end) rl[m].end=rl[i].end;
+            }
+            else rl[++m]=rl[i];
+        }
+        rl.resize(m+1);
+        for (uint i=0;i<rl.size();i++) {
+            GStr r(hdr->target_name[tid]);
+            r.appendfmt(":%u-%u", rl[i].start, rl[i].end);
+            qregion_strs.push_back(r.chars());
+        }
+    }
+    if (qregion_strs.empty())
+        GError("Error: no valid regions found in %s\n", rspec.chars());
+}
+
+//clear bundle positions (bundle starting at 1-based b_start) outside the query regions
+template <class V, class F> void maskRegions(V& bvec, int blen, int tid, int b_start, F clr) {
+    if (qregion_strs.empty() || tid<0) return;
+    int i=0;
+    if (tid<(int)qregions.size()) {
+        for (uint ri=0;ri<qregions[tid].size();ri++) {
+            int rs=(int)qregions[tid][ri].start-b_start;
+            int re=(int)qregions[tid][ri].end-b_start;
+            if (re<0) continue;
+            if (rs>=blen) break;
+            for (;i<rs;i++) clr(bvec[i]);
+            if (re+1>i) i=re+1;
+        }
+    }
+    for (;i<blen;i++) clr(bvec[i]);
+}
+
+void clearCov(uint64_t& v) { v=0; }
+void clearSam(std::pair<float,uint64_t>& v) { v.second=0; }
+
+//answer window queries from a coverage summary file (--query), without the BAM file
+void queryPyramid(GStr& pyrfn, GVec<GStr>& qregs) {
+    TCovPyramid pyr(pyrfn.chars());
+    fprintf(stdout, "#chr\tstart\tend\tlength\tcov_sum\tcov_mean\tcov_min\tcov_max\tcovered_bases\tmax_samples\n");
+    for (int i=0;i<qregs.Count();i++) {
+        GStr reg(qregs[i]);
+        uint32_t rstart=1, rend=0;
+        bool valid=parseRegion(reg, rstart, rend);
+        int tid=pyr.refId(reg.chars());
+        TCPyrStats st;
+        if (!valid || tid<0 || !pyr.query(tid, rstart, rend, st)) {
+            GMessage("Warning: invalid query region %s, skipped.\n", qregs[i].chars());
+            continue;
+        }
+        if (rend==0 || rend>pyr.refLen(tid)) rend=pyr.refLen(tid);
+        fprintf(stdout, "%s\t%u\t%u\t%lu\t%lu\t%.4f\t%u\t%u\t%lu\t%u\n", reg.chars(),
+                rstart-1, rend, (unsigned long)st.len, (unsigned long)st.sum, st.mean(),
+                st.min, st.max, (unsigned long)st.ncov, st.smax);
+    }
+}
+
+//-- query server (--serve): region summaries computed on demand from indexed,
+// already opened alignment files, and kept in an LRU cache
+struct TRegSummary {
+    uint64_t len;
+    uint64_t sum; //coverage sum (YC) over the region bases
+    uint64_t ncov; //bases with non-zero coverage
+    uint64_t maxcov;
+    uint64_t nalns; //alignment records overlapping the region
+    uint32_t smax; //max sample count (YX) of the alignments covering the region
+    std::vector<CJunc> juncs; //junctions overlapping the region, sorted
+    TRegSummary():len(0), sum(0), ncov(0), maxcov(0), nalns(0), smax(0), juncs() { }
+};
+
+class TRegCache {
+    typedef std::list< std::pair<std::string, TRegSummary> > TRegList;
+    size_t capacity;
+    TRegList lru; //most recently used first
+    std::unordered_map<std::string, TRegList::iterator> rmap;
+  public:
+    TRegCache(size_t cap):capacity(cap), lru(), rmap() { }
+    TRegSummary* find(const std::string& key) {
+        auto it=rmap.find(key);
+        if (it==rmap.end()) return NULL;
+        lru.splice(lru.begin(), lru, it->second);
+        return &(it->second->second);
+    }
+    TRegSummary* add(const std::string& key, TRegSummary& rs) {
+        if (capacity==0) return NULL;
+        if (lru.size()>=capacity) {
+            rmap.erase(lru.back().first);
+            lru.pop_back();
+        }
+        lru.push_front(std::make_pair(key, rs));
+        rmap[key]=lru.begin();
+        return &(lru.front().second);
+    }
+};
+
+//the region is processed one bundle of overlapping alignments at a time (as
+// in main()), so the memory used does not depend on the size of the region
+void computeRegion(GSamReader& rd, int tid, uint32_t rstart, uint32_t rend, TRegSummary& rs) {
+    GStr reg(rd.refName(tid));
+    reg.appendfmt(":%u-%u", rstart, rend);
+    rs=TRegSummary();
+    rs.len=rend-rstart+1;
+    if (!rd.setRegion(reg.chars())) return;
+    GVec<uint64_t> bcov;
+    GVec<uint32_t> bsmax;
+    std::unordered_set<CJunc, CJuncHash, CJuncEq> jset;
+    int b_start=0, b_end=0;
+    auto flushBundle=[&]() {
+        if (b_start==0) return;
+        int s=GMAX((int)rstart, b_start);
+        int e=GMIN((int)rend, b_end);
+        for (int p=s;p<=e;p++) {
+            uint64_t c=bcov[p-b_start];
+            if (c==0) continue;
+            rs.sum+=c;
+            rs.ncov++;
+            if (c>rs.maxcov) rs.maxcov=c;
+            if (bsmax[p-b_start]>rs.smax) rs.smax=bsmax[p-b_start];
+        }
+        bcov.setCount(0);
+        bsmax.setCount(0);
+        b_start=0;
+        b_end=0;
+    };
+    GSamRecord brec;
+    while (rd.next(brec)) {
+        if (brec.isUnmapped()) continue;
+        if ((int)brec.start>b_end) flushBundle(); //records come sorted by start
+        if (b_start==0) b_start=brec.start;
+        if ((int)brec.end>b_end) {
+            b_end=brec.end;
+            bcov.setCount(b_end-b_start+1, (uint64_t)0);
+            bsmax.setCount(b_end-b_start+1, (uint32_t)0);
+        }
+        int accYC=brec.tag_int("YC", 1);
+        addCov(brec, accYC, bcov, b_start);
+        addMax(brec, brec.tag_int("YX", 1), bsmax, b_start);
+        rs.nalns++;
+        char strand=brec.spliceStrand();
+        for (int i=1;i<brec.exons.Count();i++) {
+            CJunc j(tid, brec.exons[i-1].end+1, brec.exons[i].start-1, strand,
+                    accYC, brec.exons[i-1].len(), brec.exons[i].len());
+            if (j.end<(int)rstart || j.start>(int)rend) continue;
+            auto ins=jset.insert(j);
+            if (!ins.second) const_cast<CJunc&>(*ins.first).add(j);
+        }
+    }
+    rd.clearRegions();
+    flushBundle();
+    rs.juncs.assign(jset.begin(), jset.end());
+    std::sort(rs.juncs.begin(), rs.juncs.end());
+}
+
+volatile sig_atomic_t srvStop=0;
+void srvSigHandler(int) { srvStop=1; }
+
+// one request per line: <COV|SAMPLES|JUNC> chr:start-end [file#], FILES, QUIT or SHUTDOWN;
+// every response is terminated by an "END" line
+bool serveRequest(char* line, FILE* fout, GPVec<GSamReader>& readers, TRegCache& cache) {
+    char* cmd=strtok(line, " \t\r\n");
+    if (cmd==NULL) return true;
+    GStr scmd(cmd);
+    scmd.upper();
+    if (scmd=="QUIT") return false;
+    if (scmd=="SHUTDOWN") {
+        srvStop=1;
+        return false;
+    }
+    if (scmd=="FILES") {
+        for (int i=0;i<readers.Count();i++)
+            fprintf(fout, "%d\t%s\n", i, readers[i]->fileName());
+        fprintf(fout, "END\n");
+        return true;
+    }
+    char* sreg=strtok(NULL, " \t\r\n");
+    char* sfid=strtok(NULL, " \t\r\n");
+    int fid=(sfid==NULL) ? 0 : atoi(sfid);
+    if (sreg==NULL || (scmd!="COV" && scmd!="SAMPLES" && scmd!="JUNC")) {
+        fprintf(fout, "ERR invalid request\nEND\n");
+        return true;
+    }
+    if (fid<0 || fid>=readers.Count()) {
+        fprintf(fout, "ERR invalid file number %d\nEND\n", fid);
+        return true;
+    }
+    GSamReader& rd=*(readers[fid]);
+    GStr reg(sreg);
+    uint32_t rstart=1, rend=0;
+    if (!parseRegion(reg, rstart, rend)) {
+        fprintf(fout, "ERR invalid region %s\nEND\n", sreg);
+        return true;
+    }
+    int tid=sam_hdr_name2tid(rd.header(), reg.chars());
+    if (tid<0) {
+        fprintf(fout, "ERR unknown reference %s\nEND\n", reg.chars());
+        return true;
+    }
+    uint32_t reflen=sam_hdr_tid2len(rd.header(), tid);
+    if (rend==0 || rend>reflen) rend=reflen;
+    if (rstart>rend) {
+        fprintf(fout, "ERR invalid region %s\nEND\n", sreg);
+        return true;
+    }
+    std::string key(std::to_string(fid)+":"+std::to_string(tid)+":"+
+            std::to_string(rstart)+"-"+std::to_string(rend));
+    TRegSummary* rs=cache.find(key);
+    TRegSummary nrs;
+    if (rs==NULL) {
+        computeRegion(rd, tid, rstart, rend, nrs);
+        rs=cache.add(key, nrs);
+        if (rs==NULL) rs=&nrs;
+    }
+    if (scmd=="COV")
+        fprintf(fout, "%s\t%u\t%u\t%lu\t%lu\t%.4f\t%lu\t%lu\t%lu\n", reg.chars(), rstart-1, rend,
+                (unsigned long)rs->len, (unsigned long)rs->sum, (double)rs->sum/(double)rs->len,
+                (unsigned long)rs->maxcov, (unsigned long)rs->ncov, (unsigned long)rs->nalns);
+    else if (scmd=="SAMPLES")
+        fprintf(fout, "%s\t%u\t%u\t%u\n", reg.chars(), rstart-1, rend, rs->smax);
+    else {
+        for (uint i=0;i<rs->juncs.size();i++) {
+            CJunc& j=rs->juncs[i];
+            fprintf(fout, "%s\t%d\t%d\tJUNC%08u\t%ld\t%c\n", reg.chars(), j.start-1, j.end,
+                    i+1, (long)j.dupcount, j.strand);
+        }
+    }
+    fprintf(fout, "END\n");
+    return true;
+}
+
+void serveQueries(GStr& sockname, GVec<GStr>& fnames) {
+    GPVec<GSamReader> readers(true);
+    for (int i=0;i<fnames.Count();i++) {
+        GSamReader* rd=new GSamReader(fnames[i].chars(), SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
+        if (!rd->hasIndex())
+            GError("Error: an index is required for serving file %s\n", fnames[i].chars());
+        rd->setCacheSize((size_t)srvBgzfCacheMB<<20);
+        readers.Add(rd);
+    }
+    TRegCache cache(srvCacheEntries);
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    if (sockname.length()>=(int)sizeof(addr.sun_path))
+        GError("Error: socket path too long: %s\n", sockname.chars());
+    strcpy(addr.sun_path, sockname.chars());
+    int sfd=socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd<0) GError("Error: could not create socket\n");
+    struct stat st;
+    if (lstat(sockname.chars(), &st)==0) { //left over from a previous server?
+        if (!S_ISSOCK(st.st_mode))
+            GError("Error: %s exists and is not a socket!\n", sockname.chars());
+        int cfd=socket(AF_UNIX, SOCK_STREAM, 0);
+        if (cfd<0) GError("Error: could not create socket\n");
+        bool stale=(connect(cfd, (struct sockaddr*)&addr, sizeof(addr))<0 && errno==ECONNREFUSED);
+        close(cfd);
+        if (!stale) GError("Error: a server is already listening on %s!\n", sockname.chars());
+        unlink(sockname.chars());
+    }
+    if (bind(sfd, (struct sockaddr*)&addr, sizeof(addr))<0 || listen(sfd, 16)<0)
+        GError("Error: could not listen on socket %s\n", sockname.chars());
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler=srvSigHandler; //no SA_RESTART, so accept() is interrupted
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    if (verbose) GMessage("TieCov serving %d file(s) on %s\n", readers.Count(), sockname.chars());
+
+    char* line=NULL;
+    int lcap=1024;
+    GMALLOC(line, lcap);
+    while (!srvStop) {
+        int cfd=accept(sfd, NULL, NULL);
+        if (cfd<0) {
+            if (errno==EINTR) continue;
+            break;
+        }
+        FILE* fin=fdopen(cfd, "r");
+        FILE* fout=fdopen(dup(cfd), "w");
+        if (fin==NULL || fout==NULL) {
+            if (fin) fclose(fin); else close(cfd);
+            if (fout) fclose(fout);
+            continue;
+        }
+        while (!srvStop && fgetline(line, lcap, fin)) {
+            if (!serveRequest(line, fout, readers, cache)) break;
+            fflush(fout);
+        }
+        fclose(fout);
+        fclose(fin);
+    }
+    GFREE(line);
+    close(sfd);
+    unlink(sockname.chars());
+}
+
+inline int strandIdx(char strand) {
+    return (strand=='+') ? 0 : ((strand=='-') ? 1 : 2);
+}
+
+//flush the bundle of a per-strand or per-group coverage (cf) and sample count (sf) track
+void flushSubTrack(FILE* cf, FILE* sf, sam_hdr_t* hdr, GVec<uint64_t>& bcov,
+        std::vector<std::pair<float,uint64_t>>& bsam, int tid, int b_start) {
+    if (tid<0) return;
+    if (cf) {
+        maskRegions(bcov, bcov.Count(), tid, b_start, clearCov);
+        flushCoverage(cf, hdr, bcov, tid, b_start);
+    }
+    if (sf) {
+        discretize(bsam);
+        normalize(bsam,0.1,1.5,sample_info.size());
+        maskRegions(bsam, bsam.size(), tid, b_start, clearSam);
+        flushCoverage(sf, hdr, bsam, tid, b_start);
+    }
+}
+
+//create a per-strand or per-group BedGraph file fname<suffix>.bedgraph
+FILE* openSubTrack(GStr& fname, const char* suffix, const char* trackline) {
+    GStr fn(fname);
+    if (fn.endsWith(".bedgraph")) fn.cut(fn.length()-9);
+    fn.append(suffix);
+    fn.append(".bedgraph");
+    FILE* f=fopen(fn.chars(), "w");
+    if (f==NULL) GError("Error creating file %s\n", fn.chars());
+    fprintf(f, "%s\n", trackline);
+    return f;
+}
+
 // >------------------ main() start -----
 int main(int argc, char *argv[])  {
     processOptions(argc, argv);
+    if (!qpyrfname.is_empty()) {
+        queryPyramid(qpyrfname, qregions_args);
+        return 0;
+    }
+    if (!srvsockname.is_empty()) {
+        serveQueries(srvsockname, srvfnames);
+        return 0;
+    }
     //htsFile* hts_file=hts_open(infname.chars(), "r");
     //if (hts_file==NULL)
     //   GError("Error: could not open alignment file %s \n",infname.chars());
+    uint64_t t0=runStats ? tstat_now() : 0;
+    TMemScope mainMem(tmInput); //heap accounting ("make memacct" builds)
 	GSamReader samreader(infname.chars(), SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
+    if (runStats) {
+        runStats->addStage(tsHeaderLoad, tstat_now()-t0);
+        runStats->addInput(infname.chars());
+    }
+    mainMem.set(tmOutput);
+    if (verbose) { //sample list from the registry file or the @CO SAMPLE lines
+        std::vector<std::string> snames;
+        if (load_sample_info(samreader.header(), snames, infname.chars(), false))
+            GMessage("%s has alignments from %d sample(s)\n", infname.chars(), (int)snames.size());
+    }
+    if (!regspec.is_empty()) {
+        loadRegions(samreader.header(), regspec);
+        std::vector<char*> regs;
+        for (uint i=0;i<qregion_strs.size();i++)
+            regs.push_back((char*)qregion_strs[i].c_str());
+        if (!samreader.setRegions(regs.data(), regs.size()))
+            GError("Error: failed to query regions %s in %s\n", regspec.chars(), infname.chars());
+    }
 
-    if (!covfname.is_empty()) {
+    if (groupTracks) {
+       if (!load_group_names(samreader.header(), groupNames) || groupNames.empty())
+          GError("Error: %s has no sample groups (see tiebrush --group-tags)!\n", infname.chars());
+       gcoutf.assign(groupNames.size(), (FILE*)NULL);
+       gsoutf.assign(groupNames.size(), (FILE*)NULL);
+       for (uint g=0;g<groupNames.size();g++) {
+          GStr suffix(".");
+          suffix.append(groupNames[g].c_str());
+          if (!covfname.is_empty()) {
+             GStr tl("track type=bedGraph name=\"Coverage ");
+             tl.append(groupNames[g].c_str());
+             tl.append("\"");
+             gcoutf[g]=openSubTrack(covfname, suffix.chars(), tl.chars());
+          }
+          if (!sfname.is_empty()) {
+             GStr tl("track type=bedGraph name=\"Sample Count Heatmap ");
+             tl.append(groupNames[g].c_str());
+             tl.append("\" visibility=full graphType=\"heatmap\" color=200,100,0 altColor=0,100,200");
+             gsoutf[g]=openSubTrack(sfname, suffix.chars(), tl.chars());
+          }
+       }
+    }
+    if (stranded) {
+       for (int t=0;t<3;t++) {
+          if (!covfname.is_empty()) {
+             GStr tl("track type=bedGraph name=\"Coverage ");
+             tl.append(strandSuffix[t]+1);
+             tl.append("\"");
+             scoutf[t]=openSubTrack(covfname, strandSuffix[t], tl.chars());
+          }
+          if (!sfname.is_empty()) {
+             GStr tl("track type=bedGraph name=\"Sample Count Heatmap ");
+             tl.append(strandSuffix[t]+1);
+             tl.append("\" visibility=full graphType=\"heatmap\" color=200,100,0 altColor=0,100,200");
+             ssoutf[t]=openSubTrack(sfname, strandSuffix[t], tl.chars());
+          }
+       }
+    }
+    else if (!covfname.is_empty() && !groupTracks) {
        if (covfname=="-" || covfname=="stdout")
     	   coutf=stdout;
        else {
@@ -412,7 +862,9 @@ int main(int argc, char *argv[])  {
         		  jfname.chars());
        fprintf(joutf, "track name=junctions\n");
     }
-    if (!sfname.is_empty()) {
+    if (!pyrfname.is_empty())
+        pyrout=new TCovPyramidWriter(pyrfname.chars(), samreader.header());
+    if (!sfname.is_empty() && !stranded && !groupTracks) {
         if(std::strcmp(sfname.substr(sfname.length()-9,9).chars(),".bedgraph")!=0){ // if name does not end in .bedgraph
             sfname.append(".bedgraph");
         }
@@ -423,18 +875,52 @@ int main(int argc, char *argv[])  {
     }
 
     int prev_tid=-1;
+    mainMem.set(tmCovBundle);
     GVec<uint64_t> bcov(2048*1024);
+    GVec<uint32_t> bsmax; // max sample count (YX) per base, for the coverage summary (-p)
+    bool covNeeded=(coutf || coutf_bw || pyrout);
+    mainMem.set(tmCovSamples);
     std::vector<std::pair<float,uint64_t>> bsam(2048*1024,{0,1}); // number of samples. 1st - current average; 2nd - total number of values
     std::vector<std::set<int>> bsam_idx(2048*1024,std::set<int>{}); // for indexed runs
+    GVec<uint64_t> sbcov[3]; // per-strand coverage (--stranded)
+    std::vector<std::pair<float,uint64_t>> sbsam[3]; // per-strand sample counts
+    int ngroups=groupNames.size();
+    mainMem.set(tmCovBundle);
+    GVec<uint64_t>* gbcov=new GVec<uint64_t>[ngroups]; // per-group coverage (--groups)
+    std::vector< std::vector<std::pair<float,uint64_t>> > gbsam(ngroups); // per-group sample counts
+    GVec<int64_t> gyc, gys; // per-group tag values of the current record
     int b_end=0; //bundle start, end (1-based)
     int b_start=0; //1 based
     GSamRecord brec;
+    uint64_t bundleRecs=0; //records in the current bundle (--stats)
+    uint64_t numRecs=0;
+    TProgress* progress=(progressSecs>0) ? new TProgress(progressSecs, fileSize(infname.chars())) : NULL;
+    mainMem.set(tmInput); //samreader.next()
+    t0=runStats ? tstat_now() : 0;
     while (samreader.next(brec)) {
+        TMemScope recMem(tmOutput);
+        uint64_t tdec=0, flushNs=0;
+        if (runStats) {
+            tdec=tstat_now();
+            runStats->addDecode(0, tdec-t0, brec.get_b()->l_data);
+            runStats->inRecords++;
+            runStats->tick();
+        }
+        numRecs++;
+        if (progress && progress->due()) {
+            int64_t fpos=samreader.filePos();
+            progress->report(fpos>0 ? fpos : 0, numRecs, brec.refName(), brec.start);
+        }
         //uint32_t dupcount=0;
         std::vector<int> cur_samples;
         int endpos=brec.end;
         if (brec.refId()!=prev_tid || (int)brec.start>b_end) {
             if (prev_tid>=0) {
+              uint64_t tf=runStats ? tstat_now() : 0;
+              if (covNeeded)
+                  maskRegions(bcov, bcov.Count(), prev_tid, b_start, clearCov);
+              if (pyrout)
+                  pyrout->addBundle(prev_tid, b_start, bcov, bsmax);
               if (coutf)
                   flushCoverage(coutf,samreader.header(), bcov, prev_tid, b_start);
               if(coutf_bw)
@@ -442,42 +928,101 @@ int main(int argc, char *argv[])  {
               if (soutf) {
                   discretize(bsam);
                   normalize(bsam,0.1,1.5,sample_info.size());
+                  maskRegions(bsam, bsam.size(), prev_tid, b_start, clearSam);
                   flushCoverage(soutf,samreader.header(),bsam,prev_tid,b_start);
               }
-              if (joutf)
-                  flushJuncs(joutf, samreader.refName(prev_tid));
+              for (int t=0;t<3;t++)
+                  flushSubTrack(scoutf[t], ssoutf[t], samreader.header(), sbcov[t], sbsam[t], prev_tid, b_start);
+              for (int g=0;g<ngroups;g++)
+                  flushSubTrack(gcoutf[g], gsoutf[g], samreader.header(), gbcov[g], gbsam[g], prev_tid, b_start);
+              if (runStats) {
+                  flushNs=tstat_now()-tf;
+                  runStats->addStage(tsTrackOutput, flushNs);
+                  runStats->addBundle(bundleRecs, b_end-b_start+1);
+              }
             }
+            bundleRecs=0;
             b_start=brec.start;
             b_end=endpos;
-            if (coutf || coutf_bw) {
+            recMem.set(tmCovBundle);
+            if (covNeeded) {
                 bcov.setCount(0);
                 bcov.setCount(b_end-b_start+1);
             }
+            if (pyrout) {
+                bsmax.setCount(0);
+                bsmax.setCount(b_end-b_start+1, (uint32_t)0);
+            }
+            recMem.set(tmCovSamples);
             if (soutf) {
                 bsam.clear();
                 bsam.resize(b_end-b_start+1,{0,1});
                 bsam_idx.clear();
                 bsam_idx.resize(b_end-b_start+1,std::set<int>{});
             }
+            for (int t=0;t<3;t++) {
+                recMem.set(tmCovBundle);
+                if (scoutf[t]) {
+                    sbcov[t].setCount(0);
+                    sbcov[t].setCount(b_end-b_start+1, (uint64_t)0);
+                }
+                recMem.set(tmCovSamples);
+                if (ssoutf[t]) {
+                    sbsam[t].clear();
+                    sbsam[t].resize(b_end-b_start+1,{0,1});
+                }
+            }
+            for (int g=0;g<ngroups;g++) {
+                recMem.set(tmCovBundle);
+                if (gcoutf[g]) {
+                    gbcov[g].setCount(0);
+                    gbcov[g].setCount(b_end-b_start+1, (uint64_t)0);
+                }
+                recMem.set(tmCovSamples);
+                if (gsoutf[g]) {
+                    gbsam[g].clear();
+                    gbsam[g].resize(b_end-b_start+1,{0,1});
+                }
+            }
             prev_tid=brec.refId();
         } else { //extending current bundle
             if (b_end<endpos) {
                 b_end=endpos;
+                recMem.set(tmCovBundle);
                 bcov.setCount(b_end-b_start+1, (int)0);
+                if (pyrout)
+                    bsmax.setCount(b_end-b_start+1, (uint32_t)0);
+                for (int t=0;t<3;t++)
+                    if (scoutf[t]) sbcov[t].setCount(b_end-b_start+1, (uint64_t)0);
+                for (int g=0;g<ngroups;g++)
+                    if (gcoutf[g]) gbcov[g].setCount(b_end-b_start+1, (uint64_t)0);
+                recMem.set(tmCovSamples);
                 if (soutf){
                     bsam.resize(b_end-b_start+1,{0,1});
                     bsam_idx.resize(b_end-b_start+1,std::set<int>{});
                 }
+                for (int t=0;t<3;t++) {
+                    if (ssoutf[t]) sbsam[t].resize(b_end-b_start+1,{0,1});
+                }
+                for (int g=0;g<ngroups;g++)
+                    if (gsoutf[g]) gbsam[g].resize(b_end-b_start+1,{0,1});
             }
         }
         int accYC = 0;
         accYC = brec.tag_int("YC", 1);
-        if(coutf || coutf_bw){
+        if(covNeeded){
             addCov(brec, accYC, bcov, b_start);
         }
-        if (joutf && brec.exons.Count()>1) {
-            addJunction(brec, accYC);
+        if (pyrout) {
+            addMax(brec, brec.tag_int("YX", 1), bsmax, b_start);
+        }
+        if (joutf) {
+            recMem.set(tmJunctions);
+            flushJuncs(joutf, samreader.header(), brec.refId(), brec.start);
+            if (brec.exons.Count()>1)
+                junctions.addRead(brec, accYC);
         }
+        recMem.set(tmCovSamples); //the sample sets of bsam_idx grow below
 
         if(soutf){
             addSamples(brec,cur_samples,bsam_idx,b_start);
@@ -485,7 +1030,40 @@ int main(int argc, char *argv[])  {
             accYX = (float)brec.tag_int("YX", 1);
             addMean(brec, accYX, bsam, b_start);
         }
+        if (stranded) { //same decoded record, added to the track of its splice strand
+            int t=strandIdx(brec.spliceStrand());
+            if (scoutf[t])
+                addCov(brec, accYC, sbcov[t], b_start);
+            if (ssoutf[t])
+                addMean(brec, (float)brec.tag_int("YX", 1), sbsam[t], b_start);
+        }
+        if (ngroups>0) { //YG/YS hold the multiplicity and sample count of each group
+            int nc=brec.tag_int_array(TB_GROUP_COV_TAG, gyc);
+            int ns=brec.tag_int_array(TB_GROUP_SMP_TAG, gys);
+            for (int g=0;g<nc && g<ngroups;g++) {
+                if (gyc[g]<=0) continue;
+                if (gcoutf[g])
+                    addCov(brec, gyc[g], gbcov[g], b_start);
+                if (gsoutf[g])
+                    addMean(brec, (g<ns) ? gys[g] : 1, gbsam[g], b_start);
+            }
+        }
+        bundleRecs++;
+        if (runStats) {
+            t0=tstat_now();
+            runStats->addStage(tsCoverage, t0-tdec-flushNs);
+        }
 	} //while GSamRecord emitted
+	if (runStats && bundleRecs>0) runStats->addBundle(bundleRecs, b_end-b_start+1);
+	delete progress;
+	mainMem.set(tmOutput);
+	t0=runStats ? tstat_now() : 0;
+	if (covNeeded)
+       maskRegions(bcov, bcov.Count(), prev_tid, b_start, clearCov);
+	if (pyrout) {
+       pyrout->addBundle(prev_tid, b_start, bcov, bsmax);
+       delete pyrout; //writes the header and reference table
+	}
 	if (coutf) {
        flushCoverage(coutf,samreader.header(), bcov, prev_tid, b_start);
        if (coutf!=stdout) fclose(coutf);
@@ -493,13 +1071,25 @@ int main(int argc, char *argv[])  {
 	if (soutf) {
         discretize(bsam);
         normalize(bsam,0.1,1.5,sample_info.size());
+        maskRegions(bsam, bsam.size(), prev_tid, b_start, clearSam);
         flushCoverage(soutf,samreader.header(),bsam,prev_tid,b_start);
         if (soutf!=stdout) fclose(soutf);
 	}
 	if (joutf) {
-		flushJuncs(joutf, samreader.refName(prev_tid));
+		flushJuncs(joutf, samreader.header());
 		fclose(joutf);
 	}
+	for (int t=0;t<3;t++) {
+		flushSubTrack(scoutf[t], ssoutf[t], samreader.header(), sbcov[t], sbsam[t], prev_tid, b_start);
+		if (scoutf[t]) fclose(scoutf[t]);
+		if (ssoutf[t]) fclose(ssoutf[t]);
+	}
+	for (int g=0;g<ngroups;g++) {
+		flushSubTrack(gcoutf[g], gsoutf[g], samreader.header(), gbcov[g], gbsam[g], prev_tid, b_start);
+		if (gcoutf[g]) fclose(gcoutf[g]);
+		if (gsoutf[g]) fclose(gsoutf[g]);
+	}
+	delete[] gbcov;
 
 	// same for BigWig
     if (coutf_bw) {
@@ -515,11 +1105,16 @@ int main(int argc, char *argv[])  {
         bwClose(joutf_bw);
         bwCleanup();
     }
-
+    if (runStats) {
+        runStats->addStage(tsTrackOutput, tstat_now()-t0);
+        runStats->write(true);
+        delete runStats;
+    }
+    tmem_report(stderr);
 }// <------------------ main() end -----
 
 void processOptions(int argc, char* argv[]) {
-    GArgs args(argc, argv, "help;verbose;version;DVWhc:s:j:");
+    GArgs args(argc, argv, "help;verbose;version;tophat;stranded;groups;query=;serve=;cache=;bgzf-cache=;stats=;progress=;DVWhc:s:j:r:p:");
     args.printError(USAGE, true);
     if (args.getOpt('h') || args.getOpt("help")) {
         GMessage(USAGE);
@@ -531,14 +1126,60 @@ void processOptions(int argc, char* argv[]) {
         exit(0);
     }
 
-    if ((args.getOpt('c') || args.getOpt('s') || args.getOpt('j'))==0){
+    qpyrfname=args.getOpt("query");
+    if (!qpyrfname.is_empty()) {
+        if (args.startNonOpt()==0) {
+            GMessage(USAGE);
+            GMessage("\nError: no query regions provided!\n");
+            exit(1);
+        }
+        const char* q=NULL;
+        while ((q=args.nextNonOpt())!=NULL)
+            qregions_args.Add(GStr(q));
+        return;
+    }
+
+    srvsockname=args.getOpt("serve");
+    if (!srvsockname.is_empty()) {
+        verbose=(args.getOpt("verbose")!=NULL || args.getOpt('V')!=NULL);
+        GStr s=args.getOpt("cache");
+        if (!s.is_empty()) srvCacheEntries=s.asInt();
+        if (srvCacheEntries<0) GError("Error: invalid --cache value!\n");
+        s=args.getOpt("bgzf-cache");
+        if (!s.is_empty()) {
+            srvBgzfCacheMB=s.asInt();
+            if (srvBgzfCacheMB<1 || srvBgzfCacheMB>2047) //htslib takes it as an int
+                GError("Error: --bgzf-cache must be between 1 and 2047 (MB)!\n");
+        }
+        if (args.startNonOpt()==0) {
+            GMessage(USAGE);
+            GMessage("\nError: no input files to serve!\n");
+            exit(1);
+        }
+        const char* fn=NULL;
+        while ((fn=args.nextNonOpt())!=NULL)
+            srvfnames.Add(GStr(fn));
+        return;
+    }
+
+    if ((args.getOpt('c') || args.getOpt('s') || args.getOpt('j') || args.getOpt('p'))==0){
         GMessage(USAGE);
-        GMessage("\nError: at least one of -c/-j/-s arguments required!\n");
+        GMessage("\nError: at least one of -c/-j/-s/-p arguments required!\n");
         exit(1);
     }
 
     verbose=(args.getOpt("verbose")!=NULL || args.getOpt('V')!=NULL);
     bigwig=args.getOpt('W')!=NULL;
+    tophat=args.getOpt("tophat")!=NULL;
+    junctions.tophat=tophat;
+    stranded=args.getOpt("stranded")!=NULL;
+    if (stranded && bigwig)
+        GError("Error: stranded tracks (--stranded) can only be written in BedGraph format.\n");
+    groupTracks=args.getOpt("groups")!=NULL;
+    if (groupTracks && bigwig)
+        GError("Error: group tracks (--groups) can only be written in BedGraph format.\n");
+    if (groupTracks && stranded)
+        GError("Error: --groups and --stranded cannot be combined.\n");
 
     if (verbose) {
         fprintf(stderr, "Running TieCov " VERSION ". Command line:\n");
@@ -547,6 +1188,19 @@ void processOptions(int argc, char* argv[]) {
     covfname=args.getOpt('c');
     jfname=args.getOpt('j');
     sfname=args.getOpt('s');
+    regspec=args.getOpt('r');
+    pyrfname=args.getOpt('p');
+    if (stranded || groupTracks) { //several tracks for each of -c and -s
+        if (covfname=="-" || covfname=="stdout" || sfname=="-" || sfname=="stdout")
+            GError("Error: the tracks of %s cannot be written to stdout!\n", stranded ? "--stranded" : "--groups");
+    }
+    GStr progress_str=args.getOpt("progress");
+    if (!progress_str.is_empty()) {
+        progressSecs=progress_str.asInt();
+        if (progressSecs<1) GError("Error: invalid --progress interval!\n");
+    }
+    GStr stats_str=args.getOpt("stats");
+    if (!stats_str.is_empty()) runStats=new TRunStats(stats_str.chars(), "tiecov");
 
     covfname_bw=args.getOpt('c');
     jfname_bw=args.getOpt('j');
@@ -0,0 +1,207 @@
+#include "tmemacct.h"
+
+#ifdef TB_MEMACCT
+
+#include <atomic>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+// glibc exports its allocator under these names, so a program defining
+// malloc() and friends can still use it (all of libc's own allocations go
+// through the replacements as well). Each block gets a 16 byte header
+// with its size and tag right before the returned pointer; for aligned
+// blocks the header sits at the end of the padding.
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_realloc(void* p, size_t size);
+void* __libc_memalign(size_t align, size_t size);
+void __libc_free(void* p);
+}
+
+__thread uint8_t tmemTag=tmOther;
+
+struct TMemHdr {
+	uint64_t size; //requested size
+	uint32_t offset; //from the start of the underlying block
+	uint8_t tag;
+	uint8_t pad[3];
+};
+
+static const char* tmemNames[tmNumTags]={ "other", "input", "sort", "merge_heap", "spdata",
+		"segment_lists", "output", "cov_bundle", "cov_samples", "junctions" };
+
+struct TMemCounter {
+	std::atomic<int64_t> live;
+	std::atomic<int64_t> peak;
+	std::atomic<uint64_t> allocs;
+};
+
+static TMemCounter memCounters[tmNumTags+1]; //the last one is for all the tags
+
+static inline void countBytes(TMemCounter& c, int64_t delta) {
+	int64_t v=c.live.fetch_add(delta, std::memory_order_relaxed)+delta;
+	if (delta<=0) return;
+	int64_t p=c.peak.load(std::memory_order_relaxed);
+	while (v>p && !c.peak.compare_exchange_weak(p, v, std::memory_order_relaxed)) ;
+}
+
+static inline void countTag(int tag, int64_t delta) {
+	countBytes(memCounters[tag], delta);
+	countBytes(memCounters[tmNumTags], delta);
+}
+
+static inline TMemHdr* hdrOf(void* p) { return ((TMemHdr*)p)-1; }
+
+static void* track(void* block, uint32_t offset, size_t size, uint8_t tag) {
+	if (block==NULL) return NULL;
+	char* p=(char*)block+offset;
+	TMemHdr* h=hdrOf(p);
+	h->size=size;
+	h->offset=offset;
+	h->tag=tag;
+	countTag(tag, size);
+	memCounters[tag].allocs.fetch_add(1, std::memory_order_relaxed);
+	memCounters[tmNumTags].allocs.fetch_add(1, std::memory_order_relaxed);
+	return p;
+}
+
+static inline void* allocTagged(size_t size, uint8_t tag) {
+	if (size>SIZE_MAX-sizeof(TMemHdr)) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	return track(__libc_malloc(size+sizeof(TMemHdr)), sizeof(TMemHdr), size, tag);
+}
+
+static void* allocAligned(size_t align, size_t size) {
+	if (align<=sizeof(TMemHdr)) return allocTagged(size, tmemTag);
+	if (size>SIZE_MAX-align) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	//the user pointer is align bytes into the block, the header fits before it
+	return track(__libc_memalign(align, size+align), align, size, tmemTag);
+}
+
+extern "C" {
+
+void* malloc(size_t size) {
+	return allocTagged(size, tmemTag);
+}
+
+void free(void* p) {
+	if (p==NULL) return;
+	TMemHdr* h=hdrOf(p);
+	countTag(h->tag, -(int64_t)h->size);
+	__libc_free((char*)p-h->offset);
+}
+
+void* calloc(size_t n, size_t size) {
+	if (size && n>SIZE_MAX/size) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	void* p=allocTagged(n*size, tmemTag);
+	if (p) memset(p, 0, n*size);
+	return p;
+}
+
+void* realloc(void* p, size_t size) {
+	if (p==NULL) return malloc(size);
+	if (size==0) {
+		free(p);
+		return NULL;
+	}
+	TMemHdr* h=hdrOf(p);
+	uint8_t tag=h->tag; //a block keeps its tag
+	size_t oldsize=h->size;
+	if (h->offset!=sizeof(TMemHdr)) { //aligned block, the new one is not
+		void* np=allocTagged(size, tag);
+		if (np==NULL) return NULL;
+		memcpy(np, p, oldsize<size ? oldsize : size);
+		free(p);
+		return np;
+	}
+	if (size>SIZE_MAX-sizeof(TMemHdr)) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	void* nb=__libc_realloc(h, size+sizeof(TMemHdr));
+	if (nb==NULL) return NULL;
+	h=(TMemHdr*)nb;
+	h->size=size;
+	countTag(tag, (int64_t)size-(int64_t)oldsize);
+	return h+1;
+}
+
+void* reallocarray(void* p, size_t n, size_t size) {
+	if (size && n>SIZE_MAX/size) {
+		errno=ENOMEM;
+		return NULL;
+	}
+	return realloc(p, n*size);
+}
+
+int posix_memalign(void** pp, size_t align, size_t size) {
+	if (align%sizeof(void*)!=0 || (align & (align-1))!=0) return EINVAL;
+	void* p=allocAligned(align, size);
+	if (p==NULL) return ENOMEM;
+	*pp=p;
+	return 0;
+}
+
+void* memalign(size_t align, size_t size) {
+	return allocAligned(align, size);
+}
+
+void* aligned_alloc(size_t align, size_t size) {
+	return allocAligned(align, size);
+}
+
+void* valloc(size_t size) {
+	return allocAligned(getpagesize(), size);
+}
+
+void* pvalloc(size_t size) {
+	size_t pg=getpagesize();
+	return allocAligned(pg, (size+pg-1) & ~(pg-1));
+}
+
+size_t malloc_usable_size(void* p) {
+	return p ? hdrOf(p)->size : 0;
+}
+
+} //extern "C"
+
+void tmem_retag(void* p, TMemTag t) {
+	if (p==NULL) return;
+	TMemHdr* h=hdrOf(p);
+	if (h->tag==t) return;
+	countBytes(memCounters[h->tag], -(int64_t)h->size);
+	countBytes(memCounters[t], h->size);
+	h->tag=t;
+}
+
+void tmem_report(FILE* f) {
+	fprintf(f, "Heap usage by subsystem (MB):\n%-14s %12s %12s %14s\n", "", "live", "peak", "allocations");
+	for (int i=0;i<=tmNumTags;i++) {
+		TMemCounter& c=memCounters[i];
+		fprintf(f, "%-14s %12.2f %12.2f %14llu\n", i<tmNumTags ? tmemNames[i] : "total",
+				c.live.load()/1048576.0, c.peak.load()/1048576.0, (unsigned long long)c.allocs.load());
+	}
+}
+
+void tmem_json(FILE* f) {
+	fprintf(f, ",\n  \"memory\": {");
+	for (int i=0;i<=tmNumTags;i++) {
+		TMemCounter& c=memCounters[i];
+		fprintf(f, "%s\n    \"%s\": { \"live_bytes\": %lld, \"peak_bytes\": %lld, \"allocations\": %llu }",
+				i ? "," : "", i<tmNumTags ? tmemNames[i] : "total", (long long)c.live.load(),
+				(long long)c.peak.load(), (unsigned long long)c.allocs.load());
+	}
+	fprintf(f, "\n  }");
+}
+
+#endif
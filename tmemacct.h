@@ -0,0 +1,59 @@
+#ifndef TIEBRUSH_TMEMACCT_H_
+#define TIEBRUSH_TMEMACCT_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+// Heap accounting by subsystem ("make memacct" builds, which define TB_MEMACCT):
+// the allocator functions are replaced so that every block records the tag
+// that was current in the allocating thread, and live and peak bytes are
+// kept for each tag. Blocks keep their tag when they are reallocated or
+// freed from another subsystem; tmem_retag() moves a block that changes
+// owner. In other builds all of this compiles to nothing.
+
+enum TMemTag {
+	tmOther=0,    //not tagged below
+	tmInput,      //input readers: BGZF buffers, headers, decoded records
+	tmSort,       //record batches of the unsorted inputs
+	tmMergeHeap,  //k-way merge of the inputs
+	tmSPData,     //SPData groups: kept records, sample bit vectors and dup counts
+	tmSpacing,    //RDistanceData per-sample segment lists
+	tmOutput,     //output writers and track files
+	tmCovBundle,  //tiecov: per-base coverage of the current bundle (bcov)
+	tmCovSamples, //tiecov: per-base sample counts (bsam, bsam_idx)
+	tmJunctions,  //tiecov: junction table
+	tmNumTags
+};
+
+#ifdef TB_MEMACCT
+
+extern __thread uint8_t tmemTag; //tag of the blocks allocated by this thread
+
+//sets the allocation tag of this thread until the end of the scope
+class TMemScope {
+	uint8_t prev;
+ public:
+	TMemScope(TMemTag t):prev(tmemTag) { tmemTag=t; }
+	~TMemScope() { tmemTag=prev; }
+	void set(TMemTag t) { tmemTag=t; }
+};
+
+void tmem_retag(void* p, TMemTag t); //p must be a heap block (or NULL)
+void tmem_report(FILE* f); //table of live/peak bytes by tag
+void tmem_json(FILE* f); //the same as a "memory" member of a JSON object
+
+#else
+
+class TMemScope {
+ public:
+	TMemScope(TMemTag) { }
+	void set(TMemTag) { }
+};
+
+static inline void tmem_retag(void*, TMemTag) { }
+static inline void tmem_report(FILE*) { }
+static inline void tmem_json(FILE*) { }
+
+#endif
+
+#endif /* TIEBRUSH_TMEMACCT_H_ */
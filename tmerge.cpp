@@ -1,9 +1,15 @@
 #include "tmerge.h"
 #include "commons.h"
+#include "tmemacct.h"
 #include <string>
 #include <sstream>
 #include <stdlib.h>
 #include <cstring>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <set>
+#include <unistd.h>
 
 bool check_id(std::string& line, std::string id_tag){
     std::stringstream *line_stream = new std::stringstream(line);
@@ -54,17 +60,90 @@ void TInputFiles::addFile(const char* fn) {
 
     freaders.Add(new TSamReader(fn));
 }
-bool TInputFiles::addSam(GSamReader* r, int fidx) {
-    //requirement: all files must have the same number of SQ entries in the same order!
+void TInputFiles::addBase(const char* fn) {
+    if (fileExists(fn)<2)
+        GError("Error: file %s cannot be found!\n", fn);
+    freaders.Insert(0, new TSamReader(fn));
+    baseIdx=0;
+}
+
+//copy of hdr without the "@CO SAMPLE:" and "@CO SAMPLEREG:" lines
+static sam_hdr_t* hdrWithoutSamples(sam_hdr_t* hdr) {
+    std::string text;
+    scan_hdr_lines(hdr, [&](const char* p, const char* eol) {
+        if (eol-p>=11 && memcmp(p, "@CO\tSAMPLE", 10)==0 && (p[10]==':' ||
+                (eol-p>=14 && memcmp(p+10, "REG:", 4)==0)))
+            return true;
+        text.append(p, eol-p);
+        text+='\n';
+        return true;
+    });
+    sam_hdr_t* h=sam_hdr_parse(text.length(), text.c_str());
+    if (h==NULL) GError("Error: failed to rebuild the merged header!\n");
+    return h;
+}
+
+sam_hdr_t* TInputFiles::subsetHeader(GVec<int>& fidxs, const char* regfn) {
+    sam_hdr_t* h=hdrWithoutSamples(mHdr);
+    std::set<std::string> files; //samples are listed by file name (direct) or by source file
+    for (int i=0;i<fidxs.Count();i++) {
+        files.insert(freaders[fidxs[i]]->fname.chars());
+        files.insert(get_full_path(freaders[fidxs[i]]->fname.chars()));
+    }
+    std::vector<std::string> snames;
+    for(auto& ls : this->lineno2sample) {
+        const std::string& src=std::get<2>(ls.second).empty() ? std::get<0>(ls.second) : std::get<2>(ls.second);
+        if (files.find(src)!=files.end()) snames.push_back(std::get<0>(ls.second));
+    }
+    if (regfn!=NULL) {
+        TSampleRegistry reg;
+        reg.build(snames);
+        reg.write(regfn);
+        if (sam_hdr_add_line(h, "CO", reg.headerLine(regfn).c_str(), NULL)==-1)
+            GError("Error: unable to add the sample registry line to the header\n");
+    }
+    else {
+        for (uint i=0;i<snames.size();i++)
+            if (sam_hdr_add_line(h, "CO", ("SAMPLE:"+snames[i]).c_str(), NULL)==-1)
+                GError("Error: unable to add CO tags for file names\n");
+    }
+    return h;
+}
+
+//FNV-1a hash of the @SQ names and lengths, in order
+uint64_t sqHash(sam_hdr_t* hdr) {
+    uint64_t h=14695981039346656037ULL;
+    int nrefs=sam_hdr_nref(hdr);
+    for (int i=0;i<nrefs;i++) {
+        const char* p=sam_hdr_tid2name(hdr, i);
+        do { //including the terminal \0
+            h^=(uint8_t)(*p);
+            h*=1099511628211ULL;
+        } while (*p++);
+        uint64_t len=sam_hdr_tid2len(hdr, i);
+        for (int b=0;b<8;b++) {
+            h^=(len & 0xFF);
+            h*=1099511628211ULL;
+            len>>=8;
+        }
+    }
+    return h;
+}
+
+//checks that only depend on the file's own header (safe to run in parallel);
+// returns true if the file was produced by TieBrush
+bool TInputFiles::checkHeader(GSamReader* r, uint64_t& sq_hash, bool* unsorted) {
     kstring_t hd_line = KS_INITIALIZE;
     int res = sam_hdr_find_hd(r->header(), &hd_line);
     if (res < 0) GError("Error: failed to get @HD line from header!\n");
     //check for SO:coordinate
     kstring_t str = KS_INITIALIZE;
-    if (sam_hdr_find_tag_hd(r->header(), "SO", &str)
+    bool sorted=!(sam_hdr_find_tag_hd(r->header(), "SO", &str)
         || !str.s
-        || strcmp(str.s, "coordinate") )
-        GError("Error: %s file not coordinate-sorted!\n", r->fileName());
+        || strcmp(str.s, "coordinate"));
+    if (unsorted!=NULL) *unsorted=!sorted;
+    else if (!sorted)
+        GError("Error: %s file not coordinate-sorted (see --sort)!\n", r->fileName());
     ks_free(&hd_line);
     bool tb_file=false; //was this file a product of TieBrush? (already merged)
     res=sam_hdr_find_tag_id(r->header(), "PG", "PN", "TieBrush", "VN", &str);
@@ -72,15 +151,32 @@ bool TInputFiles::addSam(GSamReader* r, int fidx) {
     if (res==0) {
         tb_file=true;
 #ifdef _DEBUG
-        GMessage("DEBUG info: %s is a TieBrush (merged) file.\n", freaders[fidx]->fname.chars());
+        GMessage("DEBUG info: %s is a TieBrush (merged) file.\n", r->fileName());
 #endif
     }
+    ks_free(&str);
+    sq_hash=sqHash(r->header());
+    return tb_file;
+}
+
+bool TInputFiles::addSam(GSamReader* r, int fidx) {
+    uint64_t sq_hash=0;
+    bool tb_file=checkHeader(r, sq_hash);
+    addSam(r, fidx, tb_file, sq_hash);
+    return tb_file;
+}
+
+void TInputFiles::addSam(GSamReader* r, int fidx, bool tb_file, uint64_t sq_hash) {
+    //requirement: all files must have the same number of SQ entries in the same order!
+    kstring_t str = KS_INITIALIZE;
+    int res=0;
     if (mHdr==NULL) { //first file
         headerfilename = r->fileName();
         headerfiletbMerged = tb_file;
         mHdr=sam_hdr_dup(r->header());
+        mHdrSQHash=sq_hash;
     }
-    else { //check if this file has the same SQ entries in the same order
+    else if (sq_hash!=mHdrSQHash) { //check if this file has the same SQ entries in the same order
         //if it has more seqs, make it the main header
         int r_numrefs=sam_hdr_nref(r->header());
         int m_nrefs=sam_hdr_nref(mHdr);
@@ -109,6 +205,7 @@ bool TInputFiles::addSam(GSamReader* r, int fidx) {
             headerfilename = r->fileName();
             headerfiletbMerged = tb_file;
             mHdr=sam_hdr_dup(r->header());
+            mHdrSQHash=sq_hash;
         }
     }
 
@@ -128,9 +225,26 @@ bool TInputFiles::addSam(GSamReader* r, int fidx) {
                 load_hdr_samples(this->freaders[fi]->samreader->header(),this->freaders[fi]->fname.chars(),this->freaders[fi]->tbMerged,false);
             }
         }
+        // the donor's sample lines are kept only if they are written the same way
+        bool dropDonorSamples=(!sampleRegistry.is_empty() || donorSampleReg);
+        if (dropDonorSamples && this->headerfiletbMerged) {
+            sam_hdr_t* h=hdrWithoutSamples(mHdr);
+            sam_hdr_destroy(mHdr);
+            mHdr=h;
+        }
+        if (!sampleRegistry.is_empty()) { //one header line referring to the sidecar file
+            std::vector<std::string> snames;
+            for(auto& ls : this->lineno2sample) snames.push_back(std::get<0>(ls.second));
+            TSampleRegistry reg;
+            reg.build(snames);
+            reg.write(sampleRegistry.chars());
+            if (sam_hdr_add_line(mHdr, "CO", reg.headerLine(sampleRegistry.chars()).c_str(), NULL)==-1)
+                GError("Error: unable to add the sample registry line to the header\n");
+        }
+        else {
         // now that we have a full list of samples - we can add them to the header
         for(auto& ls : this->lineno2sample){ // sorted order of the map by line number
-            if(this->headerfiletbMerged && std::get<3>(ls.second)){ // if donor - can skip since already in the header
+            if(this->headerfiletbMerged && !dropDonorSamples && std::get<3>(ls.second)){ // if donor - can skip since already in the header
                 continue;
             }
             int res_rg = sam_hdr_add_line(mHdr, "CO", ("SAMPLE:"+std::get<0>(ls.second)).c_str(),NULL);
@@ -139,42 +253,60 @@ bool TInputFiles::addSam(GSamReader* r, int fidx) {
                     exit(-1);
                 }
         }
+        }
+        //the header may come from an input that was sorted here
+        if (sortInputs && sam_hdr_update_hd(mHdr, "SO", "coordinate")<0)
+            GError("Error: failed to update the @HD line of the output header\n");
         sam_hdr_add_pg(mHdr, "TieBrush",
                        "VN", pg_ver, "CL", pg_args.chars(), NULL);
         // sam_hdr_rebuild(mHdr); -- is this really needed?
     }
-    return tb_file;
+}
+
+//if the line at p (ending at eol) is a "@CO\tSAMPLE:name" line, return
+// the sample name as sname and its length as slen
+static bool sampleFromCOLine(const char* p, const char* eol, const char*& sname, int& slen) {
+    static const char* pfx="@CO\tSAMPLE:";
+    const int pfxlen=11;
+    if (eol-p<pfxlen || memcmp(p, pfx, pfxlen)!=0) return false;
+    sname=p+pfxlen;
+    const char* e=sname;
+    while (e<eol && *e!='\t') e++;
+    slen=e-sname;
+    return true;
 }
 
 void TInputFiles::load_hdr_samples(sam_hdr_t* hdr,std::string filename,bool tbMerged,bool donor){
     int sample_line_pos = 0;
     if(tbMerged){
         bool found_line = false;
-        int line_pos = 0;
-        std::string line;
-        while(true){
-            kstring_t str = KS_INITIALIZE;
-            if (sam_hdr_find_line_pos(hdr,"CO", line_pos, &str)!=0) {
-                break;
+        auto addSample=[&](const std::string& line) {
+            found_line=true;
+            this->s2l_it = this->sample2lineno.insert(std::make_pair(line,std::make_tuple(this->max_sample_id,sample_line_pos,filename,donor)));
+            if(!this->s2l_it.second){ // not inserted
+                std::cerr<<"duplicate entries detected"<<std::endl;
+                exit(-1);
             }
-            else{
-                line = std::string(str.s);
-                bool ret = get_sample_from_line(line);
-                if(ret){
-                    found_line=true;
-                    this->s2l_it = this->sample2lineno.insert(std::make_pair(line,std::make_tuple(this->max_sample_id,sample_line_pos,filename,donor)));
-                    if(!this->s2l_it.second){ // not inserted
-                        std::cerr<<"duplicate entries detected"<<std::endl;
-                        exit(-1);
-                    }
-                    this->lineno2sample.insert(std::make_pair(this->max_sample_id,std::make_tuple(line,sample_line_pos,filename,donor)));
-                    sample_line_pos++;
-                    this->max_sample_id++;
+            this->lineno2sample.insert(std::make_pair(this->max_sample_id,std::make_tuple(line,sample_line_pos,filename,donor)));
+            sample_line_pos++;
+            this->max_sample_id++;
+        };
+        //scan the header text in place instead of looking up each @CO line
+        scan_hdr_lines(hdr, [&](const char* p, const char* eol) {
+            const char* sname=NULL;
+            int slen=0;
+            if (sampleFromCOLine(p, eol, sname, slen))
+                addSample(std::string(sname, slen));
+            else if (eol-p>4 && memcmp(p, "@CO\t", 4)==0) {
+                TSampleRegistry reg;
+                std::string line(p+4, eol-p-4);
+                if (reg.loadFromHeaderLine(line.c_str(), filename.c_str())) {
+                    for (int i=0;i<reg.count();i++) addSample(reg.name(i));
+                    if (donor) donorSampleReg=true;
                 }
-                line_pos++;
             }
-            ks_free(&str);
-        }
+            return true;
+        });
         if(!found_line){
             std::cerr<<"Collapsed file does not have any CO: lines in the header"<<std::endl;
             exit(-1);
@@ -193,26 +325,11 @@ void TInputFiles::load_hdr_samples(sam_hdr_t* hdr,std::string filename,bool tbMe
 }
 
 bool TInputFiles::get_sample_from_line(std::string& line){ // returns true if is sample pg line
-    std::stringstream *line_stream = new std::stringstream(line);
-    std::string col;
-
-    // make sure it's CO - comment line
-    std::getline(*line_stream,col,'\t');
-    if(std::strcmp(col.c_str(),"@CO")!=0){
-        delete line_stream;
-        return false;
-    }
-
-    // check if ID == SAMPLE
-    std::getline(*line_stream,col,':');
-    if(std::strcmp(col.c_str(),"SAMPLE")!=0){
-        delete line_stream;
+    const char* sname=NULL;
+    int slen=0;
+    if (!sampleFromCOLine(line.c_str(), line.c_str()+line.length(), sname, slen))
         return false;
-    }
-
-    std::getline(*line_stream,col,'\t');
-    line = col;
-    delete line_stream;
+    line = std::string(sname, slen);
     return true;
 }
 
@@ -283,8 +400,8 @@ void TInputFiles::delete_all_hdr_with_tag(sam_hdr_t *hdr,std::string tag1, std::
     }
 }
 
-// todo: merge header PG tags
-int TInputFiles::start(){
+//if the only input is a text file, replace it with the alignment files listed in it
+void TInputFiles::loadFileList() {
     if (this->freaders.Count()==1) {
         //special case, if it's only one file it might be a list of file paths
         GStr& fname= this->freaders.First()->fname;
@@ -315,36 +432,276 @@ int TInputFiles::start(){
             hts_close(hf);
         }
     }
+}
 
-    for (int i=0;i<freaders.Count();++i) {
-        GSamReader* samrd=new GSamReader(freaders[i]->fname.chars(),
-                                         SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
-        bool tb_merged=addSam(samrd, i); //merge SAM headers etc.
+// todo: merge header PG tags
+int TInputFiles::start(){
+    loadFileList();
 
-        GSamRecord* brec=samrd->next();
-        if (brec)
-            recs.Add(new TInputRecord(brec, i, tb_merged));
+    //open the files, read their headers and first records concurrently
+    int nfiles=freaders.Count();
+    std::vector<GSamRecord*> firstRecs(nfiles, (GSamRecord*)NULL);
+    std::vector<int64_t> firstOffs(nfiles, -1);
+    std::vector<uint64_t> sqHashes(nfiles, 0);
+    std::vector<char> tbFlags(nfiles, 0);
+    std::atomic<int> nextFile(0);
+    int nthreads=GMIN(numThreads, nfiles);
+    //half of the sorting memory is for the batches being sorted (split between
+    // the threads), the other half for the last batch of each sorted input
+    std::atomic<int64_t> sortKeepMem((int64_t)(sortMem/2));
+    int maxRuns=(maxOpen>0) ? GMAX(1, maxOpen/nfiles) : 0; //open runs of a sorted input
+    auto loadHeaders=[&]() {
+        TMemScope ms(tmInput);
+        int i;
+        while ((i=nextFile++)<nfiles) {
+            GSamReader* samrd=new GSamReader(freaders[i]->fname.chars(),
+                                             SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
+            bool unsorted=false;
+            tbFlags[i]=checkHeader(samrd, sqHashes[i], (sortInputs && i!=baseIdx) ? &unsorted : NULL);
+            freaders[i]->samreader=samrd;
+            if (i==baseIdx) { //read by next() and nextRaw() directly, never suspended
+                if (!tbFlags[i])
+                    GError("Error: %s is not a TieBrush output file!\n", samrd->fileName());
+                baseB=readBase(NULL);
+                continue;
+            }
+            if (unsorted) { //sort it now, its sorted runs are merged by next()
+                GStr pfx(sortTmpDir);
+                pfx.appendfmt("/tbsort.%d.%d", (int)getpid(), i);
+                ms.set(tmSort);
+                TInputSorter* srt=new TInputSorter(samrd, pfx.chars(), sortMem/2/GMAX(nthreads, 1), maxRuns);
+                srt->sort(&sortKeepMem);
+                ms.set(tmInput);
+                samrd->release(); //only the header is still needed
+                freaders[i]->sorter=srt;
+                firstRecs[i]=srt->next();
+                if (firstRecs[i]==NULL) freaders[i]->release();
+                continue;
+            }
+            firstRecs[i]=samrd->next();
+            firstOffs[i]=samrd->recOffset();
+            //only the header and the first record are kept in memory until the
+            // merge reaches this input; the file is reopened then (BAM only)
+            if (firstRecs[i]) samrd->suspend();
+            else samrd->release(); //no records, header still needed for the merged header
+        }
+    };
+    if (nthreads>1) {
+        std::vector<std::thread> workers;
+        for (int t=0;t<nthreads;t++) workers.push_back(std::thread(loadHeaders));
+        for (int t=0;t<nthreads;t++) workers[t].join();
+    }
+    else loadHeaders();
+    //header merging must follow the input order
+    for (int i=0;i<nfiles;++i)
+        addSam(freaders[i]->samreader, i, tbFlags[i], sqHashes[i]); //merge SAM headers etc.
+    if (numShards>1) setupShard();
+    TMemScope ms(tmMergeHeap);
+    for (int i=0;i<nfiles;++i) {
+        if (firstRecs[i] && numShards>1 && i!=baseIdx)
+            firstRecs[i]=shardFirst(i, firstRecs[i], firstOffs[i]);
+        if (firstRecs[i])
+            recs.Add(new TInputRecord(firstRecs[i], i, tbFlags[i], firstOffs[i]));
     }
     return freaders.Count();
 }
 
+//partition the references of the merged header into numShards ranges of
+// consecutive references with about the same total length; reference t goes
+// to shard floor(N*L/total), where L is the total length of the references
+// before it, so the partition only depends on the reference dictionary
+void TInputFiles::setupShard() {
+    int nrefs=sam_hdr_nref(mHdr);
+    uint64_t total=0;
+    for (int t=0;t<nrefs;t++) total+=sam_hdr_tid2len(mHdr, t);
+    shardTidStart=nrefs;
+    shardTidEnd=nrefs;
+    uint64_t cum=0;
+    for (int t=0;t<nrefs;t++) {
+        int s=(total>0) ? (int)(cum*numShards/total) : 0;
+        if (s>=shardIdx && shardTidStart==nrefs) shardTidStart=t;
+        if (s>shardIdx) { shardTidEnd=t; break; }
+        cum+=sam_hdr_tid2len(mHdr, t);
+    }
+    //mark the merged header (replacing the mark of a sharded input, if any)
+    kstring_t str=KS_INITIALIZE;
+    int pos=0;
+    while (sam_hdr_find_line_pos(mHdr, "CO", pos, &str)==0) {
+        if (strncmp(str.s+4, TB_SHARD_TAG, strlen(TB_SHARD_TAG))==0)
+            sam_hdr_remove_line_pos(mHdr, "CO", pos);
+        else pos++;
+    }
+    ks_free(&str);
+    GStr line(TB_SHARD_TAG);
+    line.appendfmt("%d/%d", shardIdx+1, numShards);
+    if (sam_hdr_add_line(mHdr, "CO", line.chars(), NULL)==-1)
+        GError("Error: unable to add the shard line to the header\n");
+}
+
+//the first record of input fidx within the shard, given its first record r;
+// the records before the shard are skipped using the index, if available
+GSamRecord* TInputFiles::shardFirst(int fidx, GSamRecord* r, int64_t& voffs) {
+    TSamReader* rd=freaders[fidx];
+    bam1_t* b=r->get_b();
+    bool before=(b->core.tid>=0 && b->core.tid<shardTidStart);
+    if (before && rd->sorter==NULL) {
+        int64_t shardOffs=rd->samreader->refOffset(shardTidStart);
+        if (shardOffs>=0) {
+            rd->samreader->seek(shardOffs);
+            delete r;
+            r=rd->samreader->next();
+        }
+    }
+    while (r!=NULL && !inShard(r->get_b())) {
+        b=r->get_b();
+        if (!(b->core.tid>=0 && b->core.tid<shardTidStart)) { //past the shard
+            delete r;
+            r=NULL;
+            break;
+        }
+        delete r;
+        r=rd->next();
+    }
+    if (r==NULL) {
+        rd->release();
+        voffs=-1;
+        return NULL;
+    }
+    if (rd->sorter==NULL) {
+        voffs=rd->samreader->recOffset();
+        rd->samreader->suspend();
+    }
+    return r;
+}
+
+//read the next record of the base input into b (allocated if NULL);
+// returns NULL at the end of the file
+bam1_t* TInputFiles::readBase(bam1_t* b) {
+    TMemScope ms(tmInput);
+    if (b==NULL) b=bam_init1();
+    if (freaders[baseIdx]->samreader->nextRaw(b)>=0) return b;
+    bam_destroy1(b);
+    freaders[baseIdx]->release();
+    return NULL;
+}
+
+bam1_t* TInputFiles::nextRaw() {
+    if (baseB==NULL || (recs.Count()>0 && !posLess(baseB, recs.Last()->brec->get_b())))
+        return NULL;
+    bam1_t* b=baseB;
+    baseB=readBase(baseOut); //reuse the previously returned record
+    baseOut=b;
+    return b;
+}
+
 TInputRecord* TInputFiles::next() {
     //must free old current record first
     delete crec;
     crec=NULL;
+    TMemScope ms(tmMergeHeap);
+    if (baseB!=NULL && (recs.Count()==0 || !posLess(recs.Last()->brec->get_b(), baseB))) {
+        //base record at the same position as the next record of another input
+        crec=new TInputRecord(new GSamRecord(baseB, freaders[baseIdx]->samreader->header(), true),
+                baseIdx, true);
+        baseB=readBase(NULL);
+        return crec;
+    }
     if (recs.Count()>0) {
+        uint64_t t0=runStats ? tstat_now() : 0;
         crec=recs.Pop();//lowest coordinate
-        GSamRecord* rnext=freaders[crec->fidx]->samreader->next();
+        TSamReader* rd=freaders[crec->fidx];
+        uint64_t t1=runStats ? tstat_now() : 0;
+        ms.set(tmInput);
+        GSamRecord* rnext=rd->next(); //reopens a suspended file
+        ms.set(tmMergeHeap);
+        uint64_t t2=runStats ? tstat_now() : 0;
+        if (runStats) runStats->addDecode(rd->statIdx, t2-t1, rnext ? rnext->get_b()->l_data : 0);
+        if (rnext && numShards>1 && !inShard(rnext->get_b())) {
+            delete rnext; //past the shard
+            rnext=NULL;
+        }
         if (rnext)
-            recs.Add(new TInputRecord(rnext,crec->fidx, crec->tbMerged));
+            recs.Add(new TInputRecord(rnext,crec->fidx, crec->tbMerged,
+                    rd->sorter ? -1 : rd->samreader->recOffset()));
+        else rd->release(); //exhausted, free the file handle and buffers
+        if (runStats) runStats->addStage(tsMergeHeap, (t1-t0)+(tstat_now()-t2));
         //return crec->brec;
         return crec;
     }
     else return NULL;
 }
 
+bool TInputFiles::headOffsets(TInputRecord* cur, std::vector<int64_t>& offs) {
+    if (baseIdx>=0) return false;
+    offs.assign(freaders.Count(), -1);
+    for (int i=0;i<recs.Count();i++) {
+        if (recs[i]->voffset<0) return false;
+        offs[recs[i]->fidx]=recs[i]->voffset;
+    }
+    if (cur!=NULL) { //its input's next record is already in recs
+        if (cur->voffset<0) return false;
+        offs[cur->fidx]=cur->voffset;
+    }
+    return true;
+}
+
+int64_t TInputFiles::bytesTotal() {
+    int64_t total=0;
+    for (int i=0;i<freaders.Count();i++) total+=freaders[i]->fileSize();
+    return total;
+}
+
+int64_t TInputFiles::bytesDone() {
+    int64_t done=0;
+    std::vector<bool> active(freaders.Count(), false);
+    for (int i=0;i<recs.Count();i++) { //the next record of each input still being read
+        TInputRecord* r=recs[i];
+        TSamReader* rd=freaders[r->fidx];
+        active[r->fidx]=true;
+        //sorted inputs were read completely before the merge
+        if (rd->sorter!=NULL) done+=rd->fileSize();
+        else if (r->voffset>=0) done+=(r->voffset>>16);
+    }
+    if (baseB!=NULL) {
+        active[baseIdx]=true;
+        int64_t p=freaders[baseIdx]->samreader->filePos();
+        if (p>0) done+=p;
+    }
+    for (int i=0;i<freaders.Count();i++)
+        if (!active[i]) done+=freaders[i]->fileSize(); //exhausted
+    return done;
+}
+
+void TInputFiles::restart(std::vector<int64_t>& offs) {
+    if ((int)offs.size()!=freaders.Count())
+        GError("Error: cannot restart reading %d inputs from %d positions!\n",
+               freaders.Count(), (int)offs.size());
+    delete crec;
+    crec=NULL;
+    recs.Clear();
+    for (int i=0;i<freaders.Count();i++) {
+        TSamReader* rd=freaders[i];
+        if (offs[i]<0) { //already exhausted
+            rd->release();
+            continue;
+        }
+        if (rd->sorter!=NULL)
+            GError("Error: cannot restart reading sorted input %s\n", rd->fname.chars());
+        rd->samreader->seek(offs[i]);
+        GSamRecord* r=rd->samreader->next();
+        if (r==NULL) GError("Error: could not continue reading %s\n", rd->fname.chars());
+        int64_t voffs=rd->samreader->recOffset();
+        rd->samreader->suspend();
+        recs.Add(new TInputRecord(r, i, rd->tbMerged, voffs));
+    }
+}
+
 void TInputFiles::stop() {
+    if (baseB) { bam_destroy1(baseB); baseB=NULL; }
+    if (baseOut) { bam_destroy1(baseOut); baseOut=NULL; }
     for (int i=0;i<freaders.Count();++i) {
+        delete freaders[i]->sorter; //also removes its temporary files
+        freaders[i]->sorter=NULL;
         freaders[i]->samreader->bclose();
     }
 }
@@ -7,15 +7,39 @@
 #include "GVec.hh"
 #include "GList.hh"
 #include "GSam.h"
+#include "tsort.h"
+#include "tstats.h"
 #include "htslib/khash.h"
 
+//"@CO SHARD:<i>/<n>" marks the output of shard i (1-based) of a sharded run
+#define TB_SHARD_TAG "SHARD:"
+
+uint64_t sqHash(sam_hdr_t* hdr); //hash of the @SQ names and lengths, in order
+
 struct TSamReader {
 	GStr fname;
 	GSamReader* samreader;
 	bool tbMerged; //based on the header, is the file a product of TieBrush?
+	TInputSorter* sorter; //records of an unsorted input are taken from here
+	int statIdx; //input index in runStats (-1 if not reported)
+	int64_t fsize; //file size, -1 if not known yet
 	TSamReader(const char* fn=NULL, GSamReader* samr=NULL):
-		fname(fn), samreader(samr), tbMerged(false) {}
+		fname(fn), samreader(samr), tbMerged(false), sorter(NULL), statIdx(-1), fsize(-1) {}
+	int64_t fileSize() {
+		if (fsize<0) fsize=::fileSize(fname.chars());
+		if (fsize<0) fsize=0;
+		return fsize;
+	}
+	GSamRecord* next() { //the caller has to FREE the record
+		return sorter ? sorter->next() : samreader->next();
+	}
+	void release() { //input exhausted, free the file handles and buffers
+		delete sorter;
+		sorter=NULL;
+		samreader->release();
+	}
 	~TSamReader() {
+		delete sorter;
 		delete samreader;
 	}
 };
@@ -24,6 +48,7 @@ struct TInputRecord {
 	GSamRecord* brec;
 	int fidx; //file index in files and readers
 	bool tbMerged; //is it from a TieBrush generated file?
+	int64_t voffset; //virtual file offset of the record in its input (-1 if not known)
 	bool operator<(TInputRecord& o) {
 		 //decreasing location sort
 		 GSamRecord& r1=*brec;
@@ -58,8 +83,8 @@ struct TInputRecord {
     void disown() {
     	brec=NULL;
     }
-	TInputRecord(GSamRecord* b=NULL, int i=0, bool tb_merged=false):brec(b),
-			fidx(i),tbMerged(tb_merged) {}
+	TInputRecord(GSamRecord* b=NULL, int i=0, bool tb_merged=false, int64_t voffs=-1):brec(b),
+			fidx(i),tbMerged(tb_merged),voffset(voffs) {}
 	~TInputRecord() {
 		delete brec;
 	}
@@ -70,17 +95,63 @@ struct TInputFiles {
 	TInputRecord* crec;
 	// use that to check if each input SAM file has the refseqs sorted by coordinate
 	sam_hdr_t* mHdr; //merged output header data
+	uint64_t mHdrSQHash; //hash of the @SQ names and lengths in mHdr
 	char* pg_ver;
 	GStr pg_args;
+	//incremental merge: records of the base input (an existing TieBrush output)
+	// are passed through unchanged where no other input has records at the
+	// same position
+	int baseIdx; //index of the base input (-1 if none)
+	bam1_t* baseB; //next record of the base input (NULL when exhausted)
+	bam1_t* baseOut; //last record returned by nextRaw()
+	bam1_t* readBase(bam1_t* b);
+	static bool posLess(const bam1_t* a, const bam1_t* b) { //unmapped records last
+		uint32_t at=(uint32_t)a->core.tid, bt=(uint32_t)b->core.tid;
+		if (at!=bt) return at<bt;
+		return a->core.pos<b->core.pos;
+	}
+	//sharded run: only the records of the references in [shardTidStart, shardTidEnd)
+	// are merged (and the unmapped records, by the last shard)
+	int shardTidStart;
+	int shardTidEnd;
+	void setupShard();
+	bool inShard(bam1_t* b) {
+		if (b->core.tid<0) return shardIdx==numShards-1;
+		return (b->core.tid>=shardTidStart && b->core.tid<shardTidEnd);
+	}
+	GSamRecord* shardFirst(int fidx, GSamRecord* r, int64_t& voffs);
  public:
 	GPVec<TSamReader> freaders;
 	void addFile(const char* fn);
+	//the existing TieBrush output to add the other inputs to; it becomes the
+	// first input (and the header donor)
+	void addBase(const char* fn);
+	int baseInput() { return baseIdx; }
+	//per-file header checks; an input that is not coordinate-sorted is an error,
+	// unless unsorted is given (then set for such inputs)
+	static bool checkHeader(GSamReader* r, uint64_t& sq_hash, bool* unsorted=NULL);
 	bool addSam(GSamReader* r, int fidx); //update mHdr data
+	void addSam(GSamReader* r, int fidx, bool tb_file, uint64_t sq_hash);
 	GList<TInputRecord> recs; //next record for each
-	TInputFiles():crec(NULL), mHdr(NULL), pg_ver(NULL), pg_args(),
-			freaders(true), recs(true, true, true) { }
+	int numThreads; //number of threads used by start() to load the headers
+	GStr sampleRegistry; //if set, write the sample list to this sidecar file instead of @CO lines
+	bool sortInputs; //sort the inputs that are not coordinate-sorted
+	size_t sortMem; //memory budget for sorting, shared by the threads loading the inputs
+	GStr sortTmpDir; //directory for the sorted runs
+	int maxOpen; //open files limit of a merge pass (0: none); each sorted input
+	             // keeps no more than its share of it as open runs
+	int shardIdx; //0-based shard to merge, out of numShards (0: no sharding)
+	int numShards;
+	TInputFiles():crec(NULL), mHdr(NULL), mHdrSQHash(0), pg_ver(NULL), pg_args(),
+			baseIdx(-1), baseB(NULL), baseOut(NULL), shardTidStart(0), shardTidEnd(0),
+			freaders(true), recs(true, true, true), numThreads(4),
+			sampleRegistry(), sortInputs(false), sortMem(1024UL<<20), sortTmpDir("."),
+			maxOpen(0), shardIdx(0), numShards(0), donorSampleReg(false) { }
 
 	sam_hdr_t* header() { return mHdr; }
+	//copy of the merged header listing only the samples of the given files
+	// (in a new sample registry regfn, if not NULL)
+	sam_hdr_t* subsetHeader(GVec<int>& fidxs, const char* regfn=NULL);
 
 	void setup(const char* ver, int argc, char** argv) {
 		if (ver) pg_ver=Gstrdup(ver);
@@ -92,14 +163,42 @@ struct TInputFiles {
 		}
 	}
 
+	void copySetup(TInputFiles& src) { //same @PG data as src
+		GFREE(pg_ver);
+		if (src.pg_ver) pg_ver=Gstrdup(src.pg_ver);
+		pg_args=src.pg_args;
+		numThreads=src.numThreads;
+		sortInputs=src.sortInputs;
+		sortMem=src.sortMem;
+		sortTmpDir=src.sortTmpDir;
+		maxOpen=src.maxOpen;
+		shardIdx=src.shardIdx;
+		numShards=src.numShards;
+	}
+
 	~TInputFiles() {
 		GFREE(pg_ver);
 		sam_hdr_destroy(mHdr);
 	}
 
 	int count() { return freaders.Count(); }
+	void loadFileList(); //expand a single input that is a list of file paths
 	int start(); //open all files, load 1 record from each
 	TInputRecord* next();
+	//the next record of the base input, if it comes before the next record of
+	// any other input (so it cannot be merged with anything); the record is
+	// only valid until the next call
+	bam1_t* nextRaw();
+	//virtual offsets of the first record not yet processed in each input (-1
+	// for exhausted inputs), when cur is the record being processed; returns
+	// false if the reading position of some input could not be restored
+	bool headOffsets(TInputRecord* cur, std::vector<int64_t>& offs);
+	//total size of the input files, and the compressed bytes read from them so
+	// far (inputs that cannot be tracked, like SAM files, count when exhausted)
+	int64_t bytesTotal();
+	int64_t bytesDone();
+	//after start(), continue reading from the offsets given by headOffsets()
+	void restart(std::vector<int64_t>& offs);
 	void stop(); //
 
 	// index declarations
@@ -109,6 +208,7 @@ struct TInputFiles {
     bool get_sample_from_line(std::string& line);
 	std::string headerfilename; // filename of the file which was used to construct the header
 	bool headerfiletbMerged; // whether the input file from which header was borrowed was processed by tiebrush
+	bool donorSampleReg; // the header donor lists its samples in a sample registry file
 	int max_sample_id = 0; // current line number of the last sample in the merged header
 	std::map<std::string,std::tuple<int,int,std::string,bool>> sample2lineno; // value: first int is the line number; second int is the linenumber in the input file to which sample correspods; third string is the filename of the corresponding index; fourth bool is true if the sample is the one which donated the header
 	std::pair<std::map<std::string,std::tuple<int,int,std::string,bool>>::iterator,bool> s2l_it; // check for no duplicate samples
@@ -0,0 +1,131 @@
+#include "tshard.h"
+#include <algorithm>
+#include "htslib/hfile.h"
+#include "commons.h"
+#include "tmerge.h"
+
+//the empty BGZF block marking the end of a BAM file
+static const uint8_t bgzfEOF[28]={
+	0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 0x06, 0, 0x42, 0x43, 0x02, 0, 0x1b, 0,
+	0x03, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+void TShardConcat::addShard(const char* fn) {
+	BGZF* fp=bgzf_open(fn, "r");
+	if (fp==NULL) GError("Error: could not open shard file %s\n", fn);
+	TShardFile sf;
+	sf.fname=fn;
+	sf.hdr=bam_hdr_read(fp);
+	if (sf.hdr==NULL) GError("Error: %s is not a BAM file!\n", fn);
+	int64_t voffs=bgzf_tell(fp);
+	bgzf_close(fp);
+	if ((voffs & 0xFFFF)!=0) //the header is always flushed by htslib
+		GError("Error: the header of %s does not end at a BGZF block boundary!\n", fn);
+	sf.dataOffset=voffs>>16;
+	sf.idx=0;
+	int n=0;
+	const size_t tlen=strlen(TB_SHARD_TAG);
+	scan_hdr_lines(sf.hdr, [&](const char* p, const char* eol) {
+		if (eol-p>(long)(4+tlen) && memcmp(p, "@CO\t", 4)==0 && memcmp(p+4, TB_SHARD_TAG, tlen)==0) {
+			if (sscanf(p+4+tlen, "%d/%d", &sf.idx, &n)!=2) sf.idx=0;
+			return false;
+		}
+		return true;
+	});
+	if (sf.idx<1 || sf.idx>n)
+		GError("Error: %s is not the output of a sharded TieBrush run!\n", fn);
+	std::vector<std::string> smps;
+	load_sample_info(sf.hdr, smps, fn, false);
+	if (shards.empty()) {
+		numShards=n;
+		samples.swap(smps);
+	}
+	else {
+		TShardFile& first=shards[0];
+		if (n!=numShards)
+			GError("Error: %s is shard %d of %d, but %s is a shard of %d!\n", fn, sf.idx, n,
+					first.fname.c_str(), numShards);
+		if (sqHash(sf.hdr)!=sqHash(first.hdr))
+			GError("Error: shards %s and %s have different reference sequences!\n", fn, first.fname.c_str());
+		if (smps!=samples)
+			GError("Error: shards %s and %s have different samples!\n", fn, first.fname.c_str());
+		for (size_t i=0;i<shards.size();i++)
+			if (shards[i].idx==sf.idx)
+				GError("Error: shard %d given twice (%s and %s)!\n", sf.idx, shards[i].fname.c_str(), fn);
+	}
+	shards.push_back(sf);
+}
+
+void TShardConcat::load(std::vector<std::string>& fnames) {
+	for (size_t i=0;i<fnames.size();i++) addShard(fnames[i].c_str());
+	if ((int)shards.size()!=numShards)
+		GError("Error: %d shard files given, %d expected!\n", (int)shards.size(), numShards);
+	std::sort(shards.begin(), shards.end(),
+			[](const TShardFile& a, const TShardFile& b) { return a.idx<b.idx; });
+}
+
+//header of the first shard, without the shard line; a sample registry is
+// copied next to the output file
+sam_hdr_t* TShardConcat::outHeader(const char* outfn) {
+	std::string text;
+	const size_t tlen=strlen(TB_SHARD_TAG);
+	scan_hdr_lines(shards[0].hdr, [&](const char* p, const char* eol) {
+		if (eol-p>4 && memcmp(p, "@CO\t", 4)==0) {
+			if (eol-p>=(long)(4+tlen) && memcmp(p+4, TB_SHARD_TAG, tlen)==0) return true;
+			std::string line(p+4, eol-p-4);
+			TSampleRegistry reg;
+			if (reg.loadFromHeaderLine(line.c_str(), shards[0].fname.c_str())) {
+				std::string regfn(outfn);
+				regfn+=TB_SAMPLE_REG_EXT;
+				reg.write(regfn.c_str());
+				text+="@CO\t"+reg.headerLine(regfn.c_str())+"\n";
+				return true;
+			}
+		}
+		text.append(p, eol-p);
+		text+='\n';
+		return true;
+	});
+	sam_hdr_t* h=sam_hdr_parse(text.length(), text.c_str());
+	if (h==NULL) GError("Error: failed to build the header of %s\n", outfn);
+	return h;
+}
+
+//append the compressed records of a shard to out, without its EOF block
+void TShardConcat::copyBlocks(TShardFile& sf, BGZF* out) {
+	hFILE* f=hopen(sf.fname.c_str(), "r");
+	if (f==NULL || hseek(f, sf.dataOffset, SEEK_SET)<0)
+		GError("Error: could not read shard file %s\n", sf.fname.c_str());
+	std::vector<uint8_t> buf(1<<20);
+	size_t held=0; //the last bytes read, which may be the EOF block, are held back
+	ssize_t n=0;
+	while ((n=hread(f, buf.data()+held, buf.size()-held))>0) {
+		held+=n;
+		if (held<=sizeof(bgzfEOF)) continue;
+		size_t len=held-sizeof(bgzfEOF);
+		if (bgzf_raw_write(out, buf.data(), len)<0)
+			GError("Error writing shard %s data\n", sf.fname.c_str());
+		memmove(buf.data(), buf.data()+len, sizeof(bgzfEOF));
+		held=sizeof(bgzfEOF);
+	}
+	if (n<0) GError("Error reading shard file %s\n", sf.fname.c_str());
+	if (held!=sizeof(bgzfEOF) || memcmp(buf.data(), bgzfEOF, held)!=0) {
+		GMessage("Warning: shard file %s has no EOF block (truncated?)\n", sf.fname.c_str());
+		if (held>0 && bgzf_raw_write(out, buf.data(), held)<0)
+			GError("Error writing shard %s data\n", sf.fname.c_str());
+	}
+	hclose(f);
+}
+
+void TShardConcat::write(const char* outfn, bool index) {
+	sam_hdr_t* h=outHeader(outfn);
+	BGZF* out=bgzf_open(outfn, "w");
+	if (out==NULL) GError("Error: could not create output file %s\n", outfn);
+	if (bam_hdr_write(out, h)<0 || bgzf_flush(out)<0) //shard blocks must start a new block
+		GError("Error writing header data to file %s\n", outfn);
+	sam_hdr_destroy(h);
+	for (size_t i=0;i<shards.size();i++) copyBlocks(shards[i], out);
+	if (bgzf_close(out)<0) GError("Error closing output file %s\n", outfn);
+	//the index has to be rebuilt, as the shards are usually not indexed
+	if (index && sam_index_build(outfn, 0)<0)
+		GError("Error: could not index %s\n", outfn);
+}
@@ -0,0 +1,39 @@
+#ifndef TIEBRUSH_TSHARD_H_
+#define TIEBRUSH_TSHARD_H_
+
+#include <vector>
+#include <string>
+#include "GBase.h"
+#include "htslib/sam.h"
+#include "htslib/bgzf.h"
+
+// Concatenation of the outputs of a sharded run (tiebrush --shard=i/N).
+// The shards cover consecutive ranges of references (see TInputFiles::setupShard())
+// and their headers only differ by the "@CO SHARD:" line (and the name of the
+// sample registry), so the output is the header followed by the compressed
+// BGZF blocks of each shard, copied without decompressing them.
+class TShardConcat {
+	struct TShardFile {
+		std::string fname;
+		sam_hdr_t* hdr;
+		int idx; //1-based shard index
+		int64_t dataOffset; //file offset of the first BGZF block after the header
+	};
+	std::vector<TShardFile> shards;
+	std::vector<std::string> samples; //sample list, the same for all shards
+	int numShards;
+	void addShard(const char* fn);
+	sam_hdr_t* outHeader(const char* outfn);
+	void copyBlocks(TShardFile& sf, BGZF* out);
+ public:
+	TShardConcat():shards(), samples(), numShards(0) { }
+	~TShardConcat() {
+		for (size_t i=0;i<shards.size();i++) sam_hdr_destroy(shards[i].hdr);
+	}
+	//check the shards (all N given once, same references and samples), in any order
+	void load(std::vector<std::string>& fnames);
+	//write the concatenated file, indexing it (.bai) if requested
+	void write(const char* outfn, bool index);
+};
+
+#endif /* TIEBRUSH_TSHARD_H_ */
@@ -0,0 +1,159 @@
+#include "tsort.h"
+#include "tmemacct.h"
+#include <algorithm>
+#include <unistd.h>
+
+TInputSorter::TInputSorter(GSamReader* r, const char* tmp_prefix, size_t mem_budget, int max_runs):
+		reader(r), runHdr(NULL), tmpPrefix(tmp_prefix), batchBudget(mem_budget/2), batch(), batchMem(0),
+		memPos(0), spillBatch(), spiller(), runFiles(), runCount(0), maxRuns(max_runs), runs(true), heap() {
+	if (batchBudget<(1<<20)) batchBudget=(1<<20);
+}
+
+TInputSorter::~TInputSorter() {
+	waitSpill();
+	for (size_t i=memPos;i<batch.size();i++) bam_destroy1(batch[i]);
+	for (size_t i=0;i<heap.size();i++) delete heap[i].r;
+	runs.Clear();
+	for (size_t i=0;i<runFiles.size();i++) unlink(runFiles[i].c_str());
+	if (runHdr) sam_hdr_destroy(runHdr);
+}
+
+void TInputSorter::writeRun(std::vector<bam1_t*>* recs, const std::string fname, sam_hdr_t* hdr) {
+	TMemScope ms(tmSort);
+	std::stable_sort(recs->begin(), recs->end(), recLess);
+	htsFile* f=hts_open(fname.c_str(), "wb1");
+	if (f==NULL) GError("Error: could not create temporary file %s\n", fname.c_str());
+	if (sam_hdr_write(f, hdr)<0)
+		GError("Error writing header data to file %s\n", fname.c_str());
+	for (size_t i=0;i<recs->size();i++) {
+		if (sam_write1(f, hdr, (*recs)[i])<0)
+			GError("Error writing to temporary file %s\n", fname.c_str());
+		bam_destroy1((*recs)[i]);
+	}
+	if (hts_close(f)!=0) GError("Error closing temporary file %s\n", fname.c_str());
+	recs->clear();
+}
+
+void TInputSorter::spill() {
+	waitSpill(); //only one batch is written at a time
+	spillBatch.swap(batch);
+	batchMem=0;
+	runFiles.push_back(runName());
+	spiller=std::thread(writeRun, &spillBatch, runFiles.back(), runHdr);
+}
+
+void TInputSorter::sort(std::atomic<int64_t>* keepMem) {
+	runHdr=sam_hdr_dup(reader->header()); //not shared with the reading thread
+	bam1_t* b=bam_init1();
+	while (reader->nextRaw(b)>=0) {
+		batch.push_back(b);
+		batchMem+=sizeof(bam1_t)+b->m_data;
+		if (batchMem>=batchBudget) spill();
+		b=bam_init1();
+	}
+	bam_destroy1(b);
+	if (!batch.empty()) {
+		bool keep=false;
+		if (keepMem!=NULL) {
+			int64_t avail=keepMem->load();
+			while (avail>=(int64_t)batchMem &&
+					!keepMem->compare_exchange_weak(avail, avail-(int64_t)batchMem)) ;
+			keep=(avail>=(int64_t)batchMem);
+		}
+		if (!keep) spill();
+	}
+	waitSpill();
+	if (maxRuns>0 && (int)runFiles.size()>maxRuns) mergeRuns();
+	std::stable_sort(batch.begin(), batch.end(), recLess);
+	for (size_t i=0;i<runFiles.size();i++) {
+		GSamReader* rd=new GSamReader(runFiles[i].c_str(),
+				SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
+		runs.Add(rd);
+		GSamRecord* r=rd->next();
+		if (r) heap.push_back({r, (int)i});
+	}
+	int msrc=runFiles.size(); //the in-memory batch goes after the runs
+	GSamRecord* r=nextFrom(msrc);
+	if (r) heap.push_back({r, msrc});
+	std::make_heap(heap.begin(), heap.end(), heapCmp);
+}
+
+//each stage merges groups of up to fanIn consecutive runs (so equal records
+// keep their input order), until no more than maxRuns runs are left
+void TInputSorter::mergeRuns() {
+	size_t fanIn=GMAX(2, maxRuns);
+	while ((int)runFiles.size()>maxRuns) {
+		std::vector<std::string> merged;
+		size_t i=0;
+		while (i<runFiles.size()) {
+			if (merged.size()+runFiles.size()-i<=(size_t)maxRuns) { //no need to merge the rest
+				merged.insert(merged.end(), runFiles.begin()+i, runFiles.end());
+				break;
+			}
+			size_t gend=GMIN(i+fanIn, runFiles.size());
+			if (gend-i==1) merged.push_back(runFiles[i]);
+			else {
+				merged.push_back(runName());
+				mergeGroup(i, gend, merged.back());
+			}
+			i=gend;
+		}
+		runFiles.swap(merged);
+	}
+}
+
+void TInputSorter::mergeGroup(size_t first, size_t last, const std::string& fname) {
+	TMemScope ms(tmSort);
+	GPVec<GSamReader> rds(true);
+	std::vector<TSortSrc> mheap;
+	for (size_t i=first;i<last;i++) {
+		GSamReader* rd=new GSamReader(runFiles[i].c_str(),
+				SAM_QNAME|SAM_FLAG|SAM_RNAME|SAM_POS|SAM_CIGAR|SAM_AUX);
+		rds.Add(rd);
+		GSamRecord* r=rd->next();
+		if (r) mheap.push_back({r, rds.Count()-1});
+	}
+	std::make_heap(mheap.begin(), mheap.end(), heapCmp);
+	htsFile* f=hts_open(fname.c_str(), "wb1");
+	if (f==NULL) GError("Error: could not create temporary file %s\n", fname.c_str());
+	if (sam_hdr_write(f, runHdr)<0)
+		GError("Error writing header data to file %s\n", fname.c_str());
+	while (!mheap.empty()) {
+		std::pop_heap(mheap.begin(), mheap.end(), heapCmp);
+		TSortSrc top=mheap.back();
+		mheap.pop_back();
+		if (sam_write1(f, runHdr, top.r->get_b())<0)
+			GError("Error writing to temporary file %s\n", fname.c_str());
+		delete top.r;
+		GSamRecord* r=rds[top.src]->next();
+		if (r) {
+			mheap.push_back({r, top.src});
+			std::push_heap(mheap.begin(), mheap.end(), heapCmp);
+		}
+	}
+	if (hts_close(f)!=0) GError("Error closing temporary file %s\n", fname.c_str());
+	rds.Clear();
+	for (size_t i=first;i<last;i++) unlink(runFiles[i].c_str());
+}
+
+GSamRecord* TInputSorter::nextFrom(int src) {
+	if (src<runs.Count()) return runs[src]->next();
+	if (memPos>=batch.size()) return NULL;
+	bam1_t* b=batch[memPos];
+	batch[memPos++]=NULL;
+	return new GSamRecord(b, reader->header(), true);
+}
+
+GSamRecord* TInputSorter::next() {
+	if (heap.empty()) return NULL;
+	std::pop_heap(heap.begin(), heap.end(), heapCmp);
+	TSortSrc top=heap.back();
+	heap.pop_back();
+	GSamRecord* r=nextFrom(top.src);
+	if (r) {
+		heap.push_back({r, top.src});
+		std::push_heap(heap.begin(), heap.end(), heapCmp);
+	}
+	else if (top.src<runs.Count()) runs[top.src]->release(); //run exhausted
+	return top.r;
+}
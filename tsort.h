@@ -0,0 +1,72 @@
+#ifndef TIEBRUSH_TSORT_H_
+#define TIEBRUSH_TSORT_H_
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include "GBase.h"
+#include "GList.hh"
+#include "GSam.h"
+
+// External merge sort for an input file that is not coordinate-sorted:
+// records are collected up to a memory budget, then a background thread
+// sorts the batch and spills it as a temporary BAM run (fast BGZF level 1)
+// while the next batch is being read. The spilled runs and the last batch
+// (kept in memory, if allowed) are merged on the fly by next(), so the sorted data goes
+// straight into the k-way merge of the inputs. If there are more runs than
+// can be kept open (maxRuns), groups of runs are first merged into longer
+// runs, in as many stages as needed.
+class TInputSorter {
+	struct TSortSrc { //next record of a run (or of the in-memory batch)
+		GSamRecord* r;
+		int src;
+	};
+	GSamReader* reader; //the unsorted input
+	sam_hdr_t* runHdr; //copy of the input header, for writing the runs
+	std::string tmpPrefix; //run files are <tmpPrefix>.<n>.bam
+	size_t batchBudget; //bytes of record data per batch (two batches can be in memory)
+	std::vector<bam1_t*> batch; //records being collected, then the last (in-memory) batch
+	size_t batchMem;
+	size_t memPos; //next record of the in-memory batch to merge
+	std::vector<bam1_t*> spillBatch; //batch being sorted and written by spiller
+	std::thread spiller;
+	std::vector<std::string> runFiles;
+	int runCount; //run files created so far (for their names)
+	int maxRuns; //max number of runs to keep open for next() (0: no limit)
+	GPVec<GSamReader> runs; //readers for the spilled runs
+	std::vector<TSortSrc> heap;
+	void spill();
+	void waitSpill() { if (spiller.joinable()) spiller.join(); }
+	static void writeRun(std::vector<bam1_t*>* recs, const std::string fname, sam_hdr_t* hdr);
+	std::string runName() {
+		char sfx[32];
+		sprintf(sfx, ".%d.bam", runCount++);
+		return tmpPrefix+sfx;
+	}
+	void mergeRuns(); //reduce the number of runs to maxRuns
+	void mergeGroup(size_t first, size_t last, const std::string& fname);
+	GSamRecord* nextFrom(int src);
+	static bool heapCmp(const TSortSrc& a, const TSortSrc& b) { //lowest record on top
+		if (recLess(b.r->get_b(), a.r->get_b())) return true;
+		if (recLess(a.r->get_b(), b.r->get_b())) return false;
+		return a.src>b.src; //keep the input order of equal records
+	}
+ public:
+	//coordinate order (unmapped records last)
+	static bool recLess(const bam1_t* a, const bam1_t* b) {
+		uint32_t at=(uint32_t)a->core.tid, bt=(uint32_t)b->core.tid;
+		if (at!=bt) return at<bt;
+		return a->core.pos<b->core.pos;
+	}
+	TInputSorter(GSamReader* r, const char* tmp_prefix, size_t mem_budget, int max_runs=0);
+	~TInputSorter();
+	//read all the input records, spilling sorted runs as needed; the last batch
+	// stays in memory if its size can be taken from keepMem, otherwise (or if
+	// keepMem is NULL) it is spilled as well
+	void sort(std::atomic<int64_t>* keepMem=NULL);
+	GSamRecord* next(); //next record in coordinate order; the caller must free it
+	int numRuns() { return runFiles.size(); }
+};
+
+#endif /* TIEBRUSH_TSORT_H_ */
@@ -0,0 +1,141 @@
+#include "tstats.h"
+#include "tmemacct.h"
+#include <sys/resource.h>
+#include <algorithm>
+
+TRunStats* runStats=NULL;
+
+const char* TRunStats::stageNames[tsNumStages]={ "header_load", "decode", "merge_heap",
+		"passes_options", "add_pdata", "flush_pdata", "output_encode", "coverage", "track_output" };
+
+TRunStats::TRunStats(const char* fn, const char* prog, int secs):fname(fn), program(prog),
+		tstart(tstat_now()), lastWrite(time(NULL)), interval(secs), tickCount(0), inputs(),
+		numBundles(0), bundleRecs(0), maxBundleRecs(0), maxBundleLen(0), maxGroupSize(0),
+		inRecords(0), outRecords(0) {
+	for (int i=0;i<tsNumStages;i++) {
+		stageNs[i]=0;
+		stageCalls[i]=0;
+	}
+}
+
+static void jsonStr(FILE* f, const char* s) {
+	fputc('"', f);
+	for (;*s;s++) {
+		if (*s=='"' || *s=='\\') fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s<0x20) fprintf(f, "\\u%04x", (unsigned char)*s);
+		else fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+//the report is replaced only when completely written
+void TRunStats::write(bool complete) {
+	std::string tmpfn(fname);
+	tmpfn+=".tmp";
+	FILE* f=fopen(tmpfn.c_str(), "w");
+	if (f==NULL) GError("Error creating statistics file %s\n", tmpfn.c_str());
+	double elapsed=(tstat_now()-tstart)/1e9;
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	fprintf(f, "{\n  \"program\": ");
+	jsonStr(f, program.c_str());
+	fprintf(f, ",\n  \"complete\": %s,\n  \"elapsed_sec\": %.3f,\n  \"max_rss_kb\": %ld,\n",
+			complete ? "true" : "false", elapsed, (long)ru.ru_maxrss);
+	fprintf(f, "  \"input_records\": %llu,\n  \"output_records\": %llu,\n",
+			(unsigned long long)inRecords, (unsigned long long)outRecords);
+	fprintf(f, "  \"stages\": {");
+	bool first=true;
+	for (int i=0;i<tsNumStages;i++) {
+		if (stageCalls[i]==0) continue;
+		fprintf(f, "%s\n    \"%s\": { \"calls\": %llu, \"sec\": %.6f }", first ? "" : ",",
+				stageNames[i], (unsigned long long)stageCalls[i], stageNs[i]/1e9);
+		first=false;
+	}
+	fprintf(f, "\n  },\n  \"inputs\": [");
+	for (size_t i=0;i<inputs.size();i++) {
+		TInputStats& in=inputs[i];
+		double sec=in.ns/1e9;
+		fprintf(f, "%s\n    { \"file\": ", i ? "," : "");
+		jsonStr(f, in.fname.c_str());
+		fprintf(f, ", \"records\": %llu, \"bytes\": %llu, \"decode_sec\": %.6f, \"records_per_sec\": %.1f }",
+				(unsigned long long)in.records, (unsigned long long)in.bytes, sec,
+				sec>0 ? in.records/sec : 0.0);
+	}
+	fprintf(f, "\n  ],\n  \"bundles\": { \"count\": %llu, \"mean_records\": %.2f, \"max_records\": %llu",
+			(unsigned long long)numBundles, numBundles ? (double)bundleRecs/numBundles : 0.0,
+			(unsigned long long)maxBundleRecs);
+	if (maxBundleLen>0) fprintf(f, ", \"max_length\": %llu", (unsigned long long)maxBundleLen);
+	fprintf(f, " },\n  \"spdata_max_group\": %llu", (unsigned long long)maxGroupSize);
+	tmem_json(f); //heap usage by subsystem, "make memacct" builds only
+	fprintf(f, "\n}\n");
+	if (fclose(f)!=0) GError("Error writing statistics file %s\n", tmpfn.c_str());
+	if (rename(tmpfn.c_str(), fname.c_str())!=0)
+		GError("Error renaming statistics file %s\n", tmpfn.c_str());
+	lastWrite=time(NULL);
+}
+
+static const char* fmtBytes(char* buf, size_t len, int64_t b) {
+	if (b>=(1LL<<30)) snprintf(buf, len, "%.2f GB", b/1073741824.0);
+	else snprintf(buf, len, "%.1f MB", b/1048576.0);
+	return buf;
+}
+
+void TProgress::report(int64_t done, uint64_t records, const char* ctg, int64_t pos) {
+	done+=doneBase;
+	if (done>totalBytes) done=totalBytes;
+	double elapsed=(tstat_now()-tstart)/1e9;
+	double rate=(elapsed>0) ? done/elapsed : 0; //bytes/s, over the whole run
+	char eta[32]="--:--:--";
+	if (rate>0) {
+		long secs=(long)((totalBytes-done)/rate);
+		snprintf(eta, sizeof(eta), "%02ld:%02ld:%02ld", secs/3600, (secs/60)%60, secs%60);
+	}
+	char dbuf[32], tbuf[32];
+	GMessage("Progress: %5.1f%% (%s of %s) at %s:%lld, %.0f records/s, %.1f MB/s, ETA %s\n",
+			totalBytes>0 ? done*100.0/totalBytes : 0.0, fmtBytes(dbuf, sizeof(dbuf), done),
+			fmtBytes(tbuf, sizeof(tbuf), totalBytes), ctg ? ctg : "*", (long long)pos,
+			elapsed>0 ? records/elapsed : 0.0, rate/1048576.0, eta);
+	lastReport=time(NULL);
+}
+
+void THotLoci::offer(THotLocus& l) {
+	for (int k=0;k<hkNumKeys;k++) {
+		auto greater=[k](const THotLocus& a, const THotLocus& b) { return key(a, k)>key(b, k); };
+		std::vector<THotLocus>& h=top[k];
+		if ((int)h.size()<topK) {
+			h.push_back(l);
+			std::push_heap(h.begin(), h.end(), greater);
+		}
+		else if (topK>0 && key(l, k)>key(h.front(), k)) {
+			std::pop_heap(h.begin(), h.end(), greater);
+			h.back()=l;
+			std::push_heap(h.begin(), h.end(), greater);
+		}
+	}
+}
+
+//the positions in any of the top lists, most time consuming first
+void THotLoci::write(const char* fname, sam_hdr_t* hdr) {
+	std::vector<THotLocus> loci;
+	for (int k=0;k<hkNumKeys;k++)
+		loci.insert(loci.end(), top[k].begin(), top[k].end());
+	std::sort(loci.begin(), loci.end(), [](const THotLocus& a, const THotLocus& b) {
+		uint64_t ta=a.addNs+a.flushNs, tb=b.addNs+b.flushNs;
+		return (ta!=tb) ? ta>tb : a.id<b.id;
+	});
+	loci.erase(std::unique(loci.begin(), loci.end(),
+			[](const THotLocus& a, const THotLocus& b) { return a.id==b.id; }), loci.end());
+	FILE* f=fopen(fname, "w");
+	if (f==NULL) GError("Error creating file %s\n", fname);
+	fprintf(f, "#top %d positions by records, groups, comparisons and time (%llu positions)\n",
+			topK, (unsigned long long)numPos);
+	fprintf(f, "#contig\tpos\trecords\tgroups\tcomparisons\tadd_pdata_ms\tflush_pdata_ms\n");
+	for (size_t i=0;i<loci.size();i++) {
+		THotLocus& l=loci[i];
+		fprintf(f, "%s\t%lld\t%llu\t%llu\t%llu\t%.3f\t%.3f\n",
+				l.tid>=0 ? sam_hdr_tid2name(hdr, l.tid) : "*", (long long)l.pos,
+				(unsigned long long)l.records, (unsigned long long)l.groups, (unsigned long long)l.cmps,
+				l.addNs/1e6, l.flushNs/1e6);
+	}
+	if (fclose(f)!=0) GError("Error writing file %s\n", fname);
+}
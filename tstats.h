@@ -0,0 +1,172 @@
+#ifndef TIEBRUSH_TSTATS_H_
+#define TIEBRUSH_TSTATS_H_
+
+#include <vector>
+#include <string>
+#include <time.h>
+#include "GBase.h"
+#include "htslib/sam.h"
+
+// Run statistics (--stats): time spent in each processing stage, per-input
+// throughput and bundle sizes, written as a JSON report at exit and
+// periodically during the run. Everything is recorded from the main thread
+// only, and nothing is measured when runStats is NULL.
+
+enum TStatStage {
+	tsHeaderLoad=0, //open the inputs, load and merge their headers
+	tsDecode,       //read and decode the input records (also per input)
+	tsMergeHeap,    //k-way merge of the inputs
+	tsFilter,       //passes_options()
+	tsGroup,        //addPData(): find or add the matching SPData
+	tsFlush,        //flushPData(): YC/YX/YD tags (output encoding excluded)
+	tsEncode,       //encoding and compression of the output records
+	tsCoverage,     //tiecov: adding alignments to the coverage bundles
+	tsTrackOutput,  //tiecov: writing the bundles to the output tracks
+	tsNumStages
+};
+
+static inline uint64_t tstat_now() { //nanoseconds
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000ULL+ts.tv_nsec;
+}
+
+class TRunStats {
+	struct TInputStats {
+		std::string fname;
+		uint64_t records;
+		uint64_t bytes; //decoded record data
+		uint64_t ns;
+		TInputStats(const char* fn=""):fname(fn), records(0), bytes(0), ns(0) { }
+	};
+	std::string fname; //JSON report
+	std::string program;
+	uint64_t tstart;
+	time_t lastWrite;
+	int interval; //seconds between reports written during the run
+	uint32_t tickCount;
+	uint64_t stageNs[tsNumStages];
+	uint64_t stageCalls[tsNumStages];
+	std::vector<TInputStats> inputs;
+	uint64_t numBundles;
+	uint64_t bundleRecs; //records in all the bundles
+	uint64_t maxBundleRecs;
+	uint64_t maxBundleLen; //bases (tiecov)
+	uint64_t maxGroupSize; //max SPData entries at one position
+ public:
+	static const char* stageNames[tsNumStages];
+	uint64_t inRecords;
+	uint64_t outRecords;
+	TRunStats(const char* fn, const char* prog, int secs=60);
+	void addStage(TStatStage st, uint64_t ns) {
+		stageNs[st]+=ns;
+		stageCalls[st]++;
+	}
+	int addInput(const char* fn) { //returns the input index
+		inputs.push_back(TInputStats(fn));
+		return inputs.size()-1;
+	}
+	void addDecode(int i, uint64_t ns, uint64_t bytes) { //i<0: not a reported input
+		addStage(tsDecode, ns);
+		if (i<0) return;
+		TInputStats& in=inputs[i];
+		in.records++;
+		in.bytes+=bytes;
+		in.ns+=ns;
+	}
+	void addBundle(uint64_t recs, uint64_t len=0) {
+		numBundles++;
+		bundleRecs+=recs;
+		if (recs>maxBundleRecs) maxBundleRecs=recs;
+		if (len>maxBundleLen) maxBundleLen=len;
+	}
+	void groupSize(uint64_t n) { if (n>maxGroupSize) maxGroupSize=n; }
+	//called often: writes the report if the interval has passed
+	void tick() {
+		if ((++tickCount & 0xFFF)==0 && interval>0 && time(NULL)-lastWrite>=interval)
+			write(false);
+	}
+	void write(bool complete);
+};
+
+extern TRunStats* runStats;
+
+// Progress report (--progress): the fraction of the input bytes already
+// read, from the compressed (BGZF) offset of each input, with the rate and
+// estimated time left; the hot loop only calls due(), which looks at the
+// clock once every 1024 calls
+class TProgress {
+	int interval; //seconds between reports
+	int64_t totalBytes;
+	uint64_t tstart;
+	time_t lastReport;
+	uint32_t tickCount;
+ public:
+	int64_t doneBase; //bytes of the inputs already merged in earlier passes
+	TProgress(int secs, int64_t total):interval(secs), totalBytes(total), tstart(tstat_now()),
+			lastReport(time(NULL)), tickCount(0), doneBase(0) { }
+	bool due() {
+		return ((++tickCount & 0x3FF)==0 && time(NULL)-lastReport>=interval);
+	}
+	//done: bytes read by the current pass; ctg may be NULL
+	void report(int64_t done, uint64_t records, const char* ctg, int64_t pos);
+};
+
+// Hot-locus report (--hot-loci): for each alignment start position, the
+// input records, the distinct alignments they were collapsed into, the
+// SPData comparisons and the time spent grouping (addPData) and flushing
+// (flushPData) them; the top K positions by each of these are kept and
+// written as a TSV file at the end of the run
+struct THotLocus {
+	uint64_t id; //positions are numbered in merge order
+	int tid;
+	int64_t pos; //1-based
+	uint64_t records;
+	uint64_t groups;
+	uint64_t cmps;
+	uint64_t addNs;
+	uint64_t flushNs;
+};
+
+class THotLoci {
+	enum { hkRecords=0, hkGroups, hkCmps, hkTime, hkNumKeys };
+	int topK;
+	std::vector<THotLocus> top[hkNumKeys]; //min-heaps, by each key
+	uint64_t numPos;
+	uint64_t cmpBase; //comparison count at the start of cur
+	static uint64_t key(const THotLocus& l, int k) {
+		switch (k) {
+		  case hkRecords: return l.records;
+		  case hkGroups: return l.groups;
+		  case hkCmps: return l.cmps;
+		  default: return l.addNs+l.flushNs;
+		}
+	}
+	void offer(THotLocus& l);
+ public:
+	THotLocus cur; //position being merged; records, groups and addNs are updated by the caller
+	THotLoci(int k):topK(k), numPos(0), cmpBase(0), cur() { cur.tid=-1; }
+	//cur was flushed (in flushNs); cmpTotal is the running count of comparisons
+	void next(int tid, int64_t pos, uint64_t flushNs, uint64_t cmpTotal) {
+		cur.flushNs=flushNs;
+		cur.cmps=cmpTotal-cmpBase;
+		if (cur.records>0) offer(cur);
+		cur=THotLocus();
+		cur.id=numPos++;
+		cur.tid=tid;
+		cur.pos=pos;
+		cmpBase=cmpTotal;
+	}
+	void write(const char* fname, sam_hdr_t* hdr);
+};
+
+//times a stage for the lifetime of the object
+class TStageTimer {
+	TStatStage stage;
+	uint64_t t0;
+ public:
+	TStageTimer(TStatStage st):stage(st), t0(runStats ? tstat_now() : 0) { }
+	~TStageTimer() { if (runStats) runStats->addStage(stage, tstat_now()-t0); }
+};
+
+#endif /* TIEBRUSH_TSTATS_H_ */